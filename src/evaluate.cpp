@@ -253,6 +253,26 @@ namespace {
   }
 
 
+  // eval_init_pawns_and_kings() is eval_init() for positions with pawns and
+  // kings only: nothing can be pinned, and there are no king attackers.
+
+  template<Color Us>
+  void eval_init_pawns_and_kings(const Position& pos, EvalInfo& ei) {
+
+    const Color Them = (Us == WHITE ? BLACK : WHITE);
+
+    ei.pinnedPieces[Us] = 0;
+    ei.attackedBy[Them][KING] = pos.attacks_from<KING>(pos.square<KING>(Them));
+    ei.attackedBy[Them][ALL_PIECES] |= ei.attackedBy[Them][KING];
+    ei.attackedBy[Us][ALL_PIECES] |= ei.attackedBy[Us][PAWN] = ei.pi->pawn_attacks(Us);
+
+    for (PieceType pt = KNIGHT; pt <= QUEEN; ++pt)
+        ei.attackedBy[Us][pt] = 0;
+
+    ei.kingRing[Them] = ei.kingAttackersCount[Us] = 0;
+  }
+
+
   // evaluate_pieces() assigns bonuses and penalties to the pieces of a given
   // color and type.
 
@@ -741,16 +761,51 @@ namespace {
     return sf;
   }
 
+
+  // evaluate_pawns_and_kings() ends evaluate() when there are no pieces: there
+  // is no mobility, king danger or space to evaluate, and the game phase is the
+  // endgame. The king safety reduces to the shelter, whose endgame value is the
+  // distance to the pawns. Score has the material, imbalance and pawns terms.
+
+  Value evaluate_pawns_and_kings(const Position& pos, const EvalInfo& ei, Score score) {
+
+    assert(ei.me->game_phase() == PHASE_ENDGAME);
+
+    score +=  ei.pi->king_safety<WHITE>(pos, pos.square<KING>(WHITE))
+            - ei.pi->king_safety<BLACK>(pos, pos.square<KING>(BLACK));
+
+    score +=  evaluate_threats<WHITE, false>(pos, ei)
+            - evaluate_threats<BLACK, false>(pos, ei);
+
+    score +=  evaluate_passed_pawns<WHITE, false>(pos, ei)
+            - evaluate_passed_pawns<BLACK, false>(pos, ei);
+
+    Bitboard b;
+    if ((b = ei.pi->passed_pawns(WHITE)) != 0)
+        score += Unstoppable * int(relative_rank(WHITE, frontmost_sq(WHITE, b)));
+
+    if ((b = ei.pi->passed_pawns(BLACK)) != 0)
+        score -= Unstoppable * int(relative_rank(BLACK, frontmost_sq(BLACK, b)));
+
+    score += evaluate_initiative(pos, ei.pi->pawn_asymmetry(), eg_value(score));
+
+    ScaleFactor sf = evaluate_scale_factor(pos, ei, score);
+    Value v = eg_value(score) * int(sf) / SCALE_FACTOR_NORMAL;
+
+    return (pos.side_to_move() == WHITE ? v : -v) + Eval::Tempo;
+  }
+
 } // namespace
 
 
 /// evaluate() is the main evaluation function. It returns a static evaluation
 /// of the position from the point of view of the side to move.
 
-template<bool DoTrace>
+template<bool DoTrace, Eval::Terms T>
 Value Eval::evaluate(const Position& pos) {
 
   assert(!pos.checkers());
+  assert(T == AllTerms || pos.pieces() == pos.pieces(PAWN, KING));
 
   EvalInfo ei;
   Score score, mobility[COLOR_NB] = { SCORE_ZERO, SCORE_ZERO };
@@ -775,6 +830,14 @@ Value Eval::evaluate(const Position& pos) {
 
   // Initialize attack and king safety bitboards
   ei.attackedBy[WHITE][ALL_PIECES] = ei.attackedBy[BLACK][ALL_PIECES] = 0;
+
+  if (T == PawnsAndKingsOnly)
+  {
+      eval_init_pawns_and_kings<WHITE>(pos, ei);
+      eval_init_pawns_and_kings<BLACK>(pos, ei);
+      return evaluate_pawns_and_kings(pos, ei, score);
+  }
+
   eval_init<WHITE>(pos, ei);
   eval_init<BLACK>(pos, ei);
 
@@ -854,6 +917,7 @@ Value Eval::evaluate(const Position& pos) {
 // Explicit template instantiations
 template Value Eval::evaluate<true >(const Position&);
 template Value Eval::evaluate<false>(const Position&);
+template Value Eval::evaluate<false, Eval::PawnsAndKingsOnly>(const Position&);
 
 
 /// trace() is like evaluate(), but instead of returning a value, it returns
@@ -34,7 +34,10 @@ const Value Tempo = Value(20); // Must be visible to search
 void init();
 std::string trace(const Position& pos);
 
-template<bool DoTrace = false>
+// Without pieces every term but the pawns and kings ones is zero, and only the endgame values count
+enum Terms { AllTerms, PawnsAndKingsOnly };
+
+template<bool DoTrace = false, Terms T = AllTerms>
 Value evaluate(const Position& pos);
 }
 
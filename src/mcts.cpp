@@ -1,5 +1,6 @@
 #include <cmath>
 #include <algorithm>
+#include <thread>
 #include "syzygy/tbprobe.h"
 #include <iostream>
 #include "mcts.h"
@@ -7,7 +8,9 @@
 #include "evaluate.h"
 #include "mcts_tablebase.h"
 #include "timeman.h"
+#include "mcts_leaf.h"
 #include "mcts_pv.h"
+#include "thread.h"
 
 using std::sqrt;
 
@@ -15,172 +18,276 @@ namespace Search {
     const bool debug_UCT = false;
     const double cpuct = 0.01;
     const double explorationExponent = 0.5;
-    const float evalWeight = 0.0f;
     const int pvThreshold = 7;
     const float normalizationFactor = 200; // Something like a pawn
 
     double eval(Position& pos);
 
-    void mctsSearch(Position& pos, MCTS_Node& root) {
+    void mctsSearch(Position& pos, MCTS_Tree& tree) {
         const int printEvery = 1000;
-        // Updated by check_time()
-        initTableBase();
+        // Only the main thread checks the time and prints, the helpers search until stopped.
+        const bool mainThread = pos.this_thread() == Threads.main();
+        // Every leaf is worth as many visits as it gets rollouts, terminal positions too.
+        const NumVisits visits = leafRollouts ? LeafRollouts.rollouts_per_leaf() : 1;
 
         StateInfo sts[MAX_PLY];
         StateInfo* lastSt = sts + MAX_PLY;
         ExtMove moveBuffer[128];
-        MCTS_Node* moveHistoryBuffer[MAX_PLY];
-        MCTS_Node** moveHistory = moveHistoryBuffer;
+        RolloutLeaf rolloutLeaf;
+        MCTS_Step moveHistoryBuffer[MAX_PLY];
+        MCTS_Step* moveHistory = moveHistoryBuffer;
 
         int iteration = 0;
         while (!Signals.stop) {
+            tree.enter();
+
+            // Pruning moves the graph, so the root is fetched anew every iteration.
+            MCTS_Node& root = *tree.get_root();
             MCTS_Node* node = &root;
             StateInfo* currentSt = sts;
 
-            int rolloutResult;
+            // Both are from the point of view of the side to move at the end of the path.
+            double rolloutResult;
             double evalResult;
 
-            int numMoves = node->getNumMoves(pos, moveBuffer);
-            PlayingResult gameResult = getGameResult(pos, numMoves);
-            while (gameResult == ContinueGame && !node->isLeaf()) {
-                MCTS_Edge* child = select_child_UCT(node);
-                do_move_mcts(pos, node, currentSt, child, moveHistory);
+            while (!root.initialize(pos, moveBuffer, tree)) {
+                std::this_thread::yield();
+            }
+            // The root is searched as long as it has moves, even when its result is known: a move has to be played.
+            PlayingResult gameResult = root.numMoves ? ContinueGame : getGameResult(pos, 0);
+            while (gameResult == ContinueGame) {
+                // Open a move if one is left, select otherwise. The virtual loss steers
+                // the other threads away from the child until the result is backed up.
+                int child = node->isLeaf() ? node->open_child() : -1;
+                bool leaf = child != -1;
+                if (!leaf) {
+                    child = select_child_UCT(node);
+                }
+                node->virtualLosses[child].fetch_add(1, std::memory_order_relaxed);
+
+                do_move_mcts(pos, node, currentSt, child, moveHistory, tree);
 
                 // If we reach the maximum depth, assume repeat or whatever.
                 if (currentSt == lastSt) {
                     gameResult = Tie;
 
+                } else if (leaf || !node->initialize(pos, moveBuffer, tree)) {
+                    // A new child, or a node another thread is initializing: roll out from it
+                    // unless the game is over. Its moves are generated once, for both.
+                    gameResult = rolloutLeaf.set(pos);
+                    break;
+
                 } else {
-                    gameResult = getGameResult(pos, node->getNumMoves(pos, moveBuffer));
+                    gameResult = getGameResult(pos, node->numMoves);
                 }
             }
 
             if (gameResult != ContinueGame) {
 
-                rolloutResult = gameResult;
-                evalResult = rolloutResult;
+                rolloutResult = gameResult * visits;
+                evalResult = gameResult;
 
-            } else { // at leaf = not fully opened.
+            } else { // at a newly opened child, or at a node not initialized yet.
 
-                MCTS_Edge* childEdge = node->open_child(pos, moveBuffer);
-                do_move_mcts(pos, node, currentSt, childEdge, moveHistory);
-                if (currentSt == lastSt) {
-                    rolloutResult = Tie;
-                } else {
-                    rolloutResult = rollout(pos, currentSt, lastSt, moveBuffer);
+                // Only the evaluators with a weight are run.
+                rolloutResult = 0;
+                if (leafRollouts) {
+                    rolloutLeaf.calc_priors(LeafRollouts.feature_priors());
+                    rolloutResult = LeafRollouts.run(pos, rolloutLeaf, int(lastSt - currentSt), moveBuffer);
                 }
-                evalResult = eval(pos);
+                evalResult = leafEval ? eval(pos) : 0;
             }
 
             // Back propagation
-            while (node->incoming_edge != nullptr) {
-                node->incoming_edge->update_stats(rolloutResult, evalResult, evalWeight);
-
-                MCTS_Edge* childEdge = node->incoming_edge;
-
-                undo_move_mcts(pos, node, currentSt, moveHistory);
-
-                // Update max stats in the parent
-                node->update_child_stats(childEdge);
-                // Nega-max
+            while (moveHistory != moveHistoryBuffer) {
+                // Nega-max: the parent stores the result from the point of view of its own side to move.
                 rolloutResult = -rolloutResult;
                 evalResult = -evalResult;
+
+                undo_move_mcts(pos, node, currentSt, moveHistory);
+                node->update_stats(moveHistory->child, rolloutResult, evalResult, visits);
             }
 
-            // optionally print move
-            if (iteration % printEvery == 0) {
+            // An iteration may play many rollouts, so the time is checked after each one.
+            if (mainThread) {
                 mcts_check_time();
             }
-            if (Time.elapsed() > 1000 && iteration % printEvery == 0) {
-                sync_cout << mcts_pv_print(root) << sync_endl;
-                if (debug_UCT) {
-                    for (MCTS_Edge* edge: root.edges) {
-                        sync_cout << UCI::move(edge->move, false) << ": " << edge->numRollouts << " = ";
-                        printf("%.2f", edge->overallEval);
-                        std::cout << ", ";
+
+            // optionally print move
+            if (mainThread && iteration % printEvery == 0) {
+                if (Time.elapsed() > 1000) {
+                    sync_cout << mcts_pv_print(root) << sync_endl;
+                    if (debug_UCT) {
+                        for (int i = 0; i < root.numChildren; i++) {
+                            sync_cout << UCI::move(root.moves[i], false) << ": " << root.numRollouts[i] << " = ";
+                            printf("%.2f", root.value(i));
+                            std::cout << ", ";
+                        }
+                        std::cout << sync_endl;
                     }
-                    std::cout << sync_endl;
                 }
+            }
+
+            tree.leave();
 
+            if (tree.over_budget()) {
+                tree.prune();
             }
+
             // check-out search.cpp line 887
             iteration++;
         }
     }
 
 
-    PlayingResult rollout(Position& pos, StateInfo*& currentStateInfo, StateInfo* lastStateInfo, ExtMove* moveBuffer) {
-        // TODO: Don't initialize in getNumMoves
-        PlayingResult result = getGameResult(pos, getNumMoves(pos, moveBuffer));
-        Move movesDone[MAX_PLY];
-        int filled = 0;
-        while (result == ContinueGame) {
-            ExtMove* startingMove = moveBuffer;
-
-            ExtMove* endingMove = generate<LEGAL>(pos, startingMove);
-            int movesSize = countValidMoves(startingMove, int(endingMove - startingMove));
+    double rollout(const RolloutLeaf& leaf, int maxPlies, double adjudication, bool featurePriors, Thread* th,
+                   ExtMove* moveBuffer, uint64_t& nodes) {
+        // Copy-make: the boards played are kept, for the repetitions.
+        PKBoard boards[MAX_PLY + 1];
+        boards[0] = leaf.board;
+
+        // Every ply generates its moves once, for the result and the priors of the next move.
+        const ExtMove* moves = leaf.moves;
+        int movesSize = leaf.numMoves;
+        double result;
+        int ply = 0;
+        while (true) {
+            Move chosenMove = sampleMove(th->rng, moves, movesSize);
+            boards[ply].do_move(chosenMove, boards[ply + 1]);
+            ply++;
+
+            // The first promotion wins.
+            if (type_of(chosenMove) == PROMOTION) {
+                result = Lose;
+                break;
+            }
 
-            calc_priors(pos, startingMove, movesSize);
+            const PKBoard& board = boards[ply];
+            movesSize = int(board.generate(moveBuffer) - moveBuffer);
 
-            Move chosenMove = sampleMove(pos, startingMove);
-            pos.do_move(chosenMove, *currentStateInfo, pos.gives_check(chosenMove, CheckInfo(pos)));
-            movesDone[filled] = chosenMove;
-            filled++;
-            currentStateInfo++;
-            if (currentStateInfo == lastStateInfo) {
-                result = Tie;
+            PlayingResult gameResult = getGameResult(board, movesSize, th);
+            if (gameResult != ContinueGame) {
+                result = gameResult;
                 break;
             }
-            result = getGameResult(pos, getNumMoves(pos, moveBuffer));
-        }
 
-        for (int i = filled - 1; i >= 0; i--) {
-            currentStateInfo--;
-            pos.undo_move(movesDone[i]);
+            // Cut the rollout short, the eval grades the result.
+            if (ply == maxPlies || adjudication < 1) {
+                result = scale_eval(board.evaluate());
+                if (ply == maxPlies || std::abs(result) >= adjudication) {
+                    break;
+                }
+            }
+
+            movesSize = int(decisive_moves(board, moveBuffer, moveBuffer + movesSize) - moveBuffer);
+            if (featurePriors) {
+                calc_feature_priors(board, moveBuffer, movesSize);
+            } else {
+                calc_priors(board, moveBuffer, movesSize);
+            }
+            moves = moveBuffer;
         }
 
-        // Computed in getGameResult, notice reference above.
-        return result;
+        nodes += ply;
+
+        // Computed for the last position, return it from the point of view
+        // of the side to move at the start of the rollout.
+        return ply % 2 ? -result : result;
     }
 
-    void do_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, MCTS_Edge* childEdge, MCTS_Node**& moveHistory) {
-        // Last element in the history is the parent
-        *moveHistory = node;
+    void do_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, int child, MCTS_Step*& moveHistory,
+                      MCTS_Tree& tree) {
+        // Last element in the history is the parent and the child taken
+        moveHistory->node = node;
+        moveHistory->child = child;
         moveHistory++;
 
-        node = &childEdge->node;
-        pos.do_move(childEdge->move, *currentSt, pos.gives_check(childEdge->move, CheckInfo(pos)));
+        Move move = node->moves[child];
+        pos.do_move(move, *currentSt, pos.gives_check(move, CheckInfo(pos)));
         currentSt++;
-    }
 
-    void undo_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, MCTS_Node**& moveHistory) {
-        pos.undo_move(node->incoming_edge->move);
+        // Threads racing to create the child all get the same node out of the table.
+        MCTS_Node* next = node->children[child].load(std::memory_order_acquire);
+        if (next == nullptr) {
+            next = tree.find_or_create(pos.key());
+            node->children[child].store(next, std::memory_order_release);
+        }
+        node = next;
+    }
 
+    void undo_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, MCTS_Step*& moveHistory) {
         moveHistory--;
-        node = *moveHistory; // Last element in the history is the parent
+        node = moveHistory->node; // Last element in the history is the parent
+        pos.undo_move(node->moves[moveHistory->child]);
 
         currentSt--;
     }
 
-    MCTS_Edge* select_child_UCT(MCTS_Node* node) {
+    int select_child_UCT(MCTS_Node* node) {
         // attest( ! children.empty() );
+        const double exploration = cpuct * std::pow(node->totalVisits.load(std::memory_order_relaxed),
+                                                    explorationExponent);
+        const float* priors = node->priors;
+
+        const int numChildren = node->numChildren.load(std::memory_order_acquire);
+
         double max_UCT_score = -VALUE_INFINITE;
-        MCTS_Edge* bestEdge = nullptr;
-        for (MCTS_Edge* child: node->edges) {
-            double score = child->overallEval +
-                           cpuct * child->prior * std::pow(node->totalVisits, explorationExponent) / (1 + child->numRollouts);
+        int best = -1;
+        for (int i = 0; i < numChildren; i++) {
+            NumVisits visits = node->numRollouts[i].load(std::memory_order_relaxed);
+            NumVisits virtualLosses = node->virtualLosses[i].load(std::memory_order_relaxed);
+            double value = node->value(i);
+            if (virtualLosses > 0) {
+                value = (value * visits - virtualLosses) / (visits + virtualLosses);
+            }
+            double score = value + exploration * priors[i] / (1 + visits + virtualLosses);
             if (score > max_UCT_score) {
                 max_UCT_score = score;
-                bestEdge = child;
+                best = i;
+            }
+        }
+
+        return best;
+    }
+
+    Move merged_best_move(const std::vector<MCTS_Node*>& roots) {
+        // The trees open the root moves in different orders, so they are matched by move.
+        std::vector<Move> moves;
+        std::vector<NumVisits> visits;
+        std::vector<ValueSum> rolloutsSums;
+        for (const MCTS_Node* root : roots) {
+            for (int i = 0; i < root->numChildren; i++) {
+                size_t j = size_t(std::find(moves.begin(), moves.end(), root->moves[i]) - moves.begin());
+                if (j == moves.size()) {
+                    moves.push_back(root->moves[i]);
+                    visits.push_back(0);
+                    rolloutsSums.push_back(0);
+                }
+                visits[j] += root->numRollouts[i];
+                rolloutsSums[j] += root->rolloutsSums[i];
             }
         }
 
-        return bestEdge;
+        if (moves.empty()) {
+            return MOVE_NONE;
+        }
+
+        // Most visits, ties broken by the sum of the rollout results.
+        size_t best = 0;
+        for (size_t j = 1; j < moves.size(); j++) {
+            if (visits[j] > visits[best] || (visits[j] == visits[best] && rolloutsSums[j] > rolloutsSums[best])) {
+                best = j;
+            }
+        }
+        return moves[best];
     }
 
     double eval(Position& pos) {
+        return scale_eval(qeval(pos));
+    }
+
+    double scale_eval(Value v) {
         // k = ln(p/(1-p))/delta x => delta x = 30, p = 0.9 => k = 0.073
-        Value v = qeval(pos);
         if (abs(v) < VALUE_MATE - MAX_PLY) { // not in mate, scale to -0.9 0.9
             const double k = 0.073;
             double pawnValue = double(v) / PawnValueEg; // assume range of [-30,30]
@@ -193,42 +300,236 @@ namespace Search {
 
 }
 
-void MCTS_Node::update_child_stats(MCTS_Edge* childEdge) {
-    totalVisits++;
-    maxVisits = std::max(maxVisits, childEdge->numRollouts);
+void MCTS_Node::allocate_children(int capacity, MCTS_Arena& arena) {
+    // Widest elements first so that every array stays aligned.
+    size_t n = size_t(capacity);
+    char* block = static_cast<char*>(arena.allocate(n * (sizeof(std::atomic<MCTS_Node*>) + 2 * sizeof(std::atomic<ValueSum>)
+                                                         + sizeof(Move) + sizeof(float)
+                                                         + 2 * sizeof(std::atomic<NumVisits>)),
+                                                    alignof(std::atomic<ValueSum>)));
+    children = reinterpret_cast<std::atomic<MCTS_Node*>*>(block);
+    evalSums = reinterpret_cast<std::atomic<ValueSum>*>(children + n);
+    rolloutsSums = evalSums + n;
+    moves = reinterpret_cast<Move*>(rolloutsSums + n);
+    priors = reinterpret_cast<float*>(moves + n);
+    numRollouts = reinterpret_cast<std::atomic<NumVisits>*>(priors + n);
+    virtualLosses = numRollouts + n;
+
+    for (size_t i = 0; i < n; i++) {
+        new(children + i) std::atomic<MCTS_Node*>(nullptr);
+        new(evalSums + i) std::atomic<ValueSum>(0);
+        new(rolloutsSums + i) std::atomic<ValueSum>(0);
+        new(numRollouts + i) std::atomic<NumVisits>(0);
+        new(virtualLosses + i) std::atomic<NumVisits>(0);
+    }
 }
 
-MCTS_Edge* MCTS_Node::open_child(Position& pos, ExtMove* moveBuffer) {
-    // Precondition: not terminal, leaf => possible moves not empty
-    initialize(pos, moveBuffer);
-    // unopened_moves not empty.
-    // sample move according to prior probabilities / take maximal probability
-    UnopenedMove move = sampleMove(pos, unopened_moves.unopened_moves, unopened_moves.numMoves);
-    // remove it from unopened_moves and insert to edges.
-    unopened_moves.remove(move);
-    MCTS_Edge* childEdge = new MCTS_Edge(move.move, move.absolutePrior); // Notice Allocation here!
-    edges.push_back(childEdge);
-    return edges[edges.size() - 1];
+bool MCTS_Node::initialize(Position& pos, ExtMove* buffer, MCTS_Tree& tree) {
+    State current = state.load(std::memory_order_acquire);
+    if (current >= Expandable) {
+        return true;
+    }
+    // Only the thread that moves the node out of Uninitialized initializes it.
+    if (current == Initializing || !state.compare_exchange_strong(current, Initializing)) {
+        return false;
+    }
+
+    numMoves = int(generate<LEGAL>(pos, buffer) - buffer);
+    calc_priors(pos, buffer, numMoves);
+
+    // The moves will be opened in a random order drawn once here, proportionally to the priors,
+    // so opening a child is just taking the next slot.
+    sample_order(pos, buffer, numMoves);
+
+    // The decisive moves are opened first.
+    if (!promotedPieces(pos)) {
+        PKBoard board;
+        board.set(pos);
+        decisive_moves(board, buffer, buffer + numMoves);
+    }
+
+    tree.allocate_children(this, numMoves);
+    for (int i = 0; i < numMoves; i++) {
+        moves[i] = buffer[i].move;
+        priors[i] = buffer[i].getPrior();
+    }
+
+    state.store(numMoves == 0 ? FullyOpened : Expandable, std::memory_order_release);
+    return true;
 }
 
-MCTS_Edge* MCTS_Node::selectBest() {
-    if (!initialized) {
-        return nullptr;
-    } else {
-        NumVisits max_visits = 0;
-        MCTS_Edge* maxEdge = nullptr;
-        for (MCTS_Edge* edge: edges) {
-            if (edge->numRollouts > max_visits) {
-                max_visits = edge->numRollouts;
-                maxEdge = edge;
+int MCTS_Node::open_child() {
+    // Precondition: initialized.
+    int child = numChildren.load(std::memory_order_relaxed);
+    while (child < numMoves) {
+        if (numChildren.compare_exchange_weak(child, child + 1)) {
+            if (child + 1 == numMoves) {
+                state.store(FullyOpened, std::memory_order_release);
             }
+            return child;
+        }
+    }
+    return -1;
+}
+
+int MCTS_Node::selectBest() const {
+    NumVisits max_visits = 0;
+    int best = -1;
+    for (int i = 0; i < numChildren; i++) {
+        NumVisits visits = numRollouts[i].load(std::memory_order_relaxed);
+        if (visits > max_visits) {
+            max_visits = visits;
+            best = i;
+        }
+    }
+    return best;
+}
+
+MCTS_Node* MCTS_Tree::copy_subtree(const MCTS_Node* node, MCTS_Arena& arena, MCTS_TranspositionTable& table,
+                                    NumVisits minVisits) {
+    // Shared nodes are copied once, the table maps them to their copy.
+    MCTS_Node* copy = table.find(node->key);
+    if (copy != nullptr) {
+        return copy;
+    }
+
+    copy = arena.create<MCTS_Node>(node->key);
+    table.insert(node->key, copy);
+
+    // Nodes visited less than minVisits are collapsed back into unexpanded leaves,
+    // their statistics survive in the parents' arrays.
+    if (node->initialized() && (node->totalVisits >= minVisits || node == root)) {
+        copy->maxVisits = node->maxVisits.load();
+        copy->totalVisits = node->totalVisits.load();
+        copy->state = node->state.load();
+        copy->numMoves = node->numMoves;
+        copy->allocate_children(node->numMoves, arena);
+        std::copy(node->moves, node->moves + node->numMoves, copy->moves);
+        std::copy(node->priors, node->priors + node->numMoves, copy->priors);
+
+        copy->numChildren = node->numChildren.load();
+        for (int i = 0; i < node->numChildren; i++) {
+            MCTS_Node* child = node->children[i].load();
+            copy->children[i] = child != nullptr ? copy_subtree(child, arena, table, minVisits) : nullptr;
+            copy->evalSums[i] = node->evalSums[i].load();
+            copy->rolloutsSums[i] = node->rolloutsSums[i].load();
+            copy->numRollouts[i] = node->numRollouts[i].load();
+        }
+    }
+
+    return copy;
+}
+
+void MCTS_Tree::compact(MCTS_Node* newRoot, NumVisits minVisits) {
+    // Move the part of the graph we keep to the other arena and drop the rest.
+    int next = current ^ 1;
+    arenas[next].reset();
+    tables[next].clear();
+    MCTS_Node* copy = copy_subtree(newRoot, arenas[next], tables[next], minVisits);
+    arenas[current].reset();
+    tables[current].clear();
+    current = next;
+    root = copy;
+    update_used();
+}
+
+MCTS_Node* MCTS_Tree::set_root(const Position& pos) {
+    MCTS_Node* newRoot = root != nullptr ? tables[current].find(pos.key()) : nullptr;
+
+    if (newRoot == nullptr) {
+        clear();
+        root = find_or_create(pos.key());
+    } else if (newRoot != root) {
+        compact(newRoot, 0);
+    }
+
+    return root;
+}
+
+void MCTS_Tree::enter() {
+    while (true) {
+        active++;
+        if (!pruning) {
+            return;
+        }
+        // Step back until the pruning is done.
+        active--;
+        while (pruning) {
+            std::this_thread::yield();
         }
-        return maxEdge;
     }
 }
 
-MCTS_Node::~MCTS_Node() {
-    for (MCTS_Edge* child: edges) {
-        delete child;
+void MCTS_Tree::leave() {
+    active--;
+}
+
+void MCTS_Tree::prune() {
+    if (pruning.exchange(true)) {
+        return; // Another thread is already pruning.
+    }
+
+    while (active > 0) {
+        std::this_thread::yield();
+    }
+
+    // The graph may have been pruned since the caller looked.
+    if (2 * memory() > budget) {
+        collapse();
+    }
+
+    pruning = false;
+}
+
+void MCTS_Tree::collapse() {
+    std::vector<NumVisits> visits;
+    tables[current].for_each([&visits](const MCTS_Node* node) {
+        if (node->initialized()) {
+            visits.push_back(node->totalVisits);
+        }
+    });
+
+    // Keep the most visited expanded nodes, as many as fit in half of the share of the live graph.
+    size_t keep = std::min(visits.size(), size_t(double(visits.size()) * double(budget / 4) / double(memory())));
+    size_t cut = visits.size() - keep;
+    if (cut == 0) {
+        return;
+    }
+
+    std::nth_element(visits.begin(), visits.begin() + cut, visits.end());
+    NumVisits minVisits = visits[cut];
+
+    // With many ties at the cut, prune more than asked for rather than nothing at all.
+    if (minVisits <= *std::min_element(visits.begin(), visits.begin() + cut)) {
+        minVisits++;
+    }
+
+    compact(root, minVisits);
+}
+
+void MCTS_Tree::clear() {
+    for (int i = 0; i < 2; i++) {
+        arenas[i].reset();
+        tables[i].clear();
+    }
+    root = nullptr;
+    update_used();
+}
+
+void MCTS_TranspositionTable::clear() {
+    if (count > 0) {
+        std::fill(entries.begin(), entries.end(), Entry{0, nullptr});
+        count = 0;
+    }
+}
+
+void MCTS_TranspositionTable::grow() {
+    std::vector<Entry> old(entries.size() * 2);
+    old.swap(entries);
+    count = 0;
+    for (const Entry& entry: old) {
+        if (entry.node != nullptr) {
+            insert(entry.key, entry.node);
+        }
     }
 }
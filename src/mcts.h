@@ -1,204 +1,318 @@
 #ifndef SRC_MCTS_H
 #define SRC_MCTS_H
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <vector>
 #include "types.h"
 #include "position.h"
+#include "mcts_arena.h"
 #include "movepick.h"
 #include "mcts_chess_playing.h"
+#include "mcts_leaf.h"
 #include "mcts_prior.h"
+#include "thread_win32.h"
 
 typedef int NumVisits;
-typedef double EvalType;    // first check whether things work and only then change it to float
-
-struct UnopenedMoves {
-    UnopenedMove* unopened_moves;
-    int numMoves;
-    double sumUnopenedPriorExps;
-
-    UnopenedMoves() : unopened_moves(nullptr), numMoves(0), sumUnopenedPriorExps(0) {}
-
-    inline void initialize(Position& pos, ExtMove* buffer) {
-        ExtMove* end = generate<LEGAL>(pos, buffer);
-        int numMoves = countValidMoves(buffer, int(end - buffer));
-        // Calculate e^(x/t - max) for all elements in the buffer.
-        calc_exp_evals(pos, buffer, numMoves);
-        // And write the ExtMoves with the correct Priors to the moves vector.
-        this->numMoves = numMoves;
-        unopened_moves = new UnopenedMove[numMoves];
-
-        double expSum = 0.0;
-        for (int i = 0; i < numMoves; i++) {
-            expSum += buffer[i].getPrior();
-        }
 
-        sumUnopenedPriorExps = expSum;
+// Sums of values in [-1, 1] are kept in fixed point, so that the threads can add to them with fetch_add.
+typedef int64_t ValueSum;
+const double ValueScale = 1 << 16;
 
-        for (int i = 0; i < numMoves; i++) {
-            ExtMove& x = *buffer;
-            float expPrior = x.getPrior(); // e^x
-            UnopenedMove move(x.move, expPrior, float(expPrior / expSum));
-            unopened_moves[i] = move;
-            buffer++;
-        }
-    }
+class MCTS_Node;
+class MCTS_Tree;
 
-    void remove(UnopenedMove move) {
-        UnopenedMove* it = std::find(unopened_moves, unopened_moves + numMoves, move);
-        while (it < unopened_moves + numMoves - 1) {
-            *it = *(it + 1);
-            it++;
-        }
-        numMoves--;
-
-        sumUnopenedPriorExps -= move.expPrior;
-        for (int i = 0; i < size(); i++) {
-            UnopenedMove& move_to_update = unopened_moves[i];
-            move_to_update.relativePrior = float(move_to_update.expPrior / sumUnopenedPriorExps);
-        }
-    }
-
-    inline bool empty() {
-        return numMoves == 0;
-    }
-
-    inline int size() {
-        return numMoves;
-    }
+namespace Search {
+    // Weight of the eval in the value of a child, the rest is the rollouts'. It is the leaf evaluator
+    // policy, fixed at compile time so that an evaluator without weight is never run:
+    // 0 for the rollouts only, 1 for the eval only, a blend in between.
+    constexpr float evalWeight = 0.0f;
+    constexpr bool leafRollouts = evalWeight < 1;
+    constexpr bool leafEval = evalWeight > 0;
+}
 
+// One step of the path from the root: the child taken out of node.
+struct MCTS_Step {
+    MCTS_Node* node;
+    int child;
 };
 
-struct MCTS_Edge;
-
 class MCTS_Node {
 public:
-    // States: Uninitialized - Edges empty & unopened moves empty
-    //         Not fully opened - Edges not empty & unopened moves not empty
-    //         Fully opened - Edges not empty & unopened moves empty
-    bool initialized;
-    std::vector<MCTS_Edge*> edges;
-    UnopenedMoves unopened_moves;
-    NumVisits maxVisits;
-    NumVisits totalVisits;
-    MCTS_Edge* incoming_edge;
+    // Uninitialized - no children arrays
+    // Initializing  - a thread is generating the moves and their priors, the others must not wait for it
+    // Expandable    - numChildren < numMoves
+    // FullyOpened   - numChildren == numMoves
+    // The arrays, numMoves, the moves and the priors are published by the store of Expandable or FullyOpened.
+    enum State { Uninitialized, Initializing, Expandable, FullyOpened };
+
+    Key key;
+    std::atomic<State> state;
+    int numMoves;                 // Legal moves, one slot each in the arrays below
+    std::atomic<int> numChildren; // Opened children are the slots [0, numChildren), the unopened moves follow in opening order
+    std::atomic<NumVisits> maxVisits;
+    std::atomic<NumVisits> totalVisits;
+
+    // Statistics of the children, as parallel arrays carved out of a single arena block
+    // sized by the number of legal moves, so that selection walks sequential memory.
+    // Values are from the point of view of the side to move in this node.
+    // The statistics are atomics, backpropagation takes no lock.
+    std::atomic<MCTS_Node*>* children; // Created when the move is first made, nullptr until then
+    std::atomic<ValueSum>* evalSums;
+    std::atomic<ValueSum>* rolloutsSums;
+    Move* moves;
+    float* priors;
+    std::atomic<NumVisits>* numRollouts;
+    std::atomic<NumVisits>* virtualLosses; // Threads currently below the child, counted as losses by the selection
+
 public:
-    MCTS_Node() : MCTS_Node(nullptr) {}
+    MCTS_Node(Key _key) : key(_key), state(Uninitialized), numMoves(0), numChildren(0), maxVisits(0), totalVisits(0),
+                  children(nullptr), evalSums(nullptr), rolloutsSums(nullptr), moves(nullptr), priors(nullptr),
+                  numRollouts(nullptr), virtualLosses(nullptr) {}
 
-    MCTS_Node(MCTS_Edge* parent) : initialized(false), edges(0 /*Init with size 0*/), maxVisits(0), totalVisits(0),
-                                   incoming_edge(parent) {}
+    // The children arrays are owned by the arena, nodes are never copied.
+    MCTS_Node() = delete;
+    MCTS_Node(const MCTS_Node&) = delete;
+    MCTS_Node& operator=(const MCTS_Node&) = delete;
+
+    inline bool initialized() const {
+        return state.load(std::memory_order_acquire) >= Expandable;
+    }
 
-    inline bool fully_opened() {
-        return initialized && unopened_moves.empty();
+    inline bool fully_opened() const {
+        return state.load(std::memory_order_acquire) == FullyOpened;
     }
 
-    bool inMate() {
-        return initialized && unopened_moves.empty() && edges.empty();
+    bool inMate() const {
+        return fully_opened() && numMoves == 0;
     }
 
-    bool isLeaf() {
-        return !initialized || !unopened_moves.empty();
+    bool isLeaf() const {
+        return !fully_opened();
     }
 
-    void update_child_stats(MCTS_Edge* childEdge);
+    // Mix of the mean rollout result and the mean eval, the prior while the child is not visited.
+    inline double value(int child) const;
 
-    int getNumMoves(Position& pos, ExtMove* buffer) {
-        // Notice that always when we use getNumMoves, we immediately after initialize.
-        initialize(pos, buffer);
-        return int(edges.size() + unopened_moves.size());
+    int score(int child) const {
+        return (int) ((value(child) * 30) * int(PawnValueEg));
     }
 
-    void initialize(Position& pos, ExtMove* buffer) {
-        if (!initialized) {
-            initialized = true;
-            unopened_moves.initialize(pos, buffer);
+    // rolloutResult is the sum of the results of the visits, evalResult the eval of a single one.
+    // Also takes back the virtual loss added when the child was selected.
+    // Safe to call from several threads at once.
+    void update_stats(int child, double rolloutResult, double evalResult, NumVisits visits) {
+        if (Search::leafRollouts) {
+            rolloutsSums[child].fetch_add(ValueSum(rolloutResult * ValueScale), std::memory_order_relaxed);
         }
+        if (Search::leafEval) {
+            evalSums[child].fetch_add(ValueSum(visits * evalResult * ValueScale), std::memory_order_relaxed);
+        }
+        NumVisits childVisits = numRollouts[child].fetch_add(visits, std::memory_order_relaxed) + visits;
+        virtualLosses[child].fetch_sub(1, std::memory_order_relaxed);
+
+        totalVisits.fetch_add(visits, std::memory_order_relaxed);
+        NumVisits max = maxVisits.load(std::memory_order_relaxed);
+        while (childVisits > max && !maxVisits.compare_exchange_weak(max, childVisits, std::memory_order_relaxed)) {}
     }
 
-    MCTS_Edge* selectBest();
+    // Lock free. False when another thread is initializing the node,
+    // numMoves and the children arrays can be used once it returns true.
+    bool initialize(Position& pos, ExtMove* buffer, MCTS_Tree& tree);
 
-    MCTS_Edge* open_child(Position& pos, ExtMove* moveBuffer);
+    // Index of the most visited child, -1 if there is none.
+    int selectBest() const;
 
-    ~MCTS_Node();
+    // Index of the newly opened child, the next unopened move in the sampled order,
+    // -1 if other threads have opened all the moves. Lock free.
+    int open_child();
 
 private:
-    void transfer(const MCTS_Node& node) {
-        initialized = node.initialized;
-        edges = node.edges;
-        unopened_moves = node.unopened_moves;
-        maxVisits = node.maxVisits;
-        totalVisits = node.totalVisits;
-        incoming_edge = node.incoming_edge;
-    }
+    friend class MCTS_Tree;
+
+    void allocate_children(int capacity, MCTS_Arena& arena);
 };
 
-struct MCTS_Edge {
-    MCTS_Node node;
-    Move move;
-    float prior;
-    EvalType evalSum;
-    NumVisits numEvals;
-    NumVisits rolloutsSum;
-    NumVisits numRollouts;
-    float overallEval;
+// Position key -> node, so that all the paths reaching a position share one node.
+// Open addressing with linear probing, grown when half full.
+class MCTS_TranspositionTable {
+public:
+    MCTS_TranspositionTable() : entries(1024), count(0) {}
+
+    MCTS_Node* find(Key key) const {
+        size_t mask = entries.size() - 1;
+        for (size_t i = size_t(key) & mask; entries[i].node != nullptr; i = (i + 1) & mask) {
+            if (entries[i].key == key) {
+                return entries[i].node;
+            }
+        }
+        return nullptr;
+    }
 
-    int score() {
-        return (int) ((overallEval * 30) * int(PawnValueEg));
+    // The key must not be in the table yet.
+    void insert(Key key, MCTS_Node* node) {
+        if (2 * (count + 1) > entries.size()) {
+            grow();
+        }
+        size_t mask = entries.size() - 1;
+        size_t i = size_t(key) & mask;
+        while (entries[i].node != nullptr) {
+            i = (i + 1) & mask;
+        }
+        entries[i] = Entry{key, node};
+        count++;
     }
 
-    void update_stats(int rolloutResult, double evalResult, float evalWeight) {
-        rolloutsSum += rolloutResult;
-        numRollouts += 1;
-        evalSum += evalResult;
-        numEvals += 1;
-        overallEval = compute_overall_eval(evalWeight);
+    void clear();
+
+    size_t memory() const {
+        return entries.size() * sizeof(Entry);
     }
 
-    MCTS_Edge(Move _move, float _prior) : node(this), move(_move), prior(_prior), overallEval(_prior), // very important
-                                            evalSum(0), numEvals(0), rolloutsSum(0), numRollouts(0){}
+    template<typename F>
+    void for_each(F f) const {
+        for (const Entry& entry: entries) {
+            if (entry.node != nullptr) {
+                f(entry.node);
+            }
+        }
+    }
 
-    MCTS_Edge(): node(), move(), prior(0), evalSum(0), numEvals(0), rolloutsSum(0), numRollouts(0), overallEval(0) {}
+private:
+    struct Entry {
+        Key key;
+        MCTS_Node* node;
+    };
+
+    void grow();
+
+    std::vector<Entry> entries;
+    size_t count;
+};
 
-    MCTS_Edge(const MCTS_Edge& other) {
-        transfer(other);
+// The search graph, kept between searches. Transpositions share a single node.
+// Nodes live in one of two arenas: when the root advances, the part of the graph
+// reachable from the new root is copied into the other arena and everything else
+// is released with a single reset. The same copy collapses the least visited nodes
+// when the graph outgrows its memory budget.
+//
+// Several threads may search the graph at once. Only the table and the arena are guarded
+// by a mutex, the nodes take no lock: one thread initializes a node, moving it through
+// its atomic state, and the others roll out from it meanwhile. open_child() hands out
+// the next unopened slot with a compare and swap, and the back propagation adds to the
+// atomic statistics. Since pruning moves every node, iterations run between enter()
+// and leave(), and prune() waits for the running ones to finish.
+class MCTS_Tree {
+public:
+    MCTS_Tree() : current(0), root(nullptr), budget(16 << 20), used(0), active(0), pruning(false) {}
+
+    MCTS_Tree(const MCTS_Tree&) = delete;
+    MCTS_Tree& operator=(const MCTS_Tree&) = delete;
+
+    // Root for a search from pos. If pos is already in the graph, the part
+    // reachable from it is kept together with its statistics.
+    MCTS_Node* set_root(const Position& pos);
+
+    MCTS_Node* get_root() {
+        return root;
     }
 
-    MCTS_Edge& operator=(const MCTS_Edge& other) {
-        transfer(other);
-        return *this;
+    // Node of the position with the given key, created if the position was not reached before.
+    MCTS_Node* find_or_create(Key key) {
+        std::lock_guard<Mutex> lock(mutex);
+        MCTS_Node* node = tables[current].find(key);
+        if (node == nullptr) {
+            node = arenas[current].create<MCTS_Node>(key);
+            tables[current].insert(key, node);
+            update_used();
+        }
+        return node;
     }
 
-private:
-    void transfer(const MCTS_Edge& other) {
-        node = other.node;
-        node.incoming_edge = this; // This is the important bit!
-        move = other.move;
-        prior = other.prior;
-        evalSum = other.evalSum;
-        numEvals = other.numEvals;
-        rolloutsSum = other.rolloutsSum;
-        numRollouts = other.numRollouts;
-        overallEval = other.overallEval;
+    void clear();
+
+    // Gives the node its children arrays out of the arena.
+    void allocate_children(MCTS_Node* node, int capacity) {
+        std::lock_guard<Mutex> lock(mutex);
+        node->allocate_children(capacity, arenas[current]);
+        update_used();
+    }
+
+    // Memory budget in bytes. Half of it is for the live graph,
+    // the other half for the copy made when re-rooting or pruning.
+    void set_budget(size_t bytes) {
+        budget = bytes;
     }
 
+    // Lock free, called by every thread after every iteration.
+    bool over_budget() const {
+        return 2 * used.load(std::memory_order_relaxed) > budget;
+    }
+
+    // Collapse the least visited nodes back into unexpanded leaves,
+    // so that the graph takes about half of its share of the budget.
+    // Must be called outside of an iteration.
+    void prune();
+
+    void enter();
+    void leave();
 
 private:
-    float compute_overall_eval(float evalWeight) {
-        return ((1 - evalWeight) * (float(rolloutsSum) / float(numRollouts)) +
-                (evalWeight) * (float(evalSum) / float(numEvals)));
+    size_t memory() const {
+        return arenas[current].used() + tables[current].memory();
     }
+
+    // Publishes memory() for over_budget(), under the mutex or outside of the iterations.
+    void update_used() {
+        used.store(memory(), std::memory_order_relaxed);
+    }
+
+    void collapse();
+    void compact(MCTS_Node* newRoot, NumVisits minVisits);
+    MCTS_Node* copy_subtree(const MCTS_Node* node, MCTS_Arena& arena, MCTS_TranspositionTable& table,
+                            NumVisits minVisits);
+
+    MCTS_Arena arenas[2];
+    MCTS_TranspositionTable tables[2];
+    int current;
+    MCTS_Node* root;
+    size_t budget;
+    std::atomic<size_t> used; // memory() as of the last allocation
+    Mutex mutex;
+    std::atomic<int> active; // Threads inside an iteration
+    std::atomic<bool> pruning;
 };
 
 namespace Search {
     extern const double cpuct;
-    extern const float evalWeight;
     extern const int pvThreshold;
     extern const float normalizationFactor;
 
-    void mctsSearch(Position& pos, MCTS_Node& root);
-    MCTS_Edge* select_child_UCT(MCTS_Node* node);
-    void do_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, MCTS_Edge* childEdge, MCTS_Node**& moveHistory);
-    void undo_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, MCTS_Node**& moveHistory);
-    PlayingResult rollout(Position& pos, StateInfo*& currentStateInfo, StateInfo* lastStateInfo, ExtMove* moveBuffer);
+    void mctsSearch(Position& pos, MCTS_Tree& tree);
+    int select_child_UCT(MCTS_Node* node);
+    void do_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, int child, MCTS_Step*& moveHistory, MCTS_Tree& tree);
+    void undo_move_mcts(Position& pos, MCTS_Node*& node, StateInfo*& currentSt, MCTS_Step*& moveHistory);
+    // Plays on the pawns and kings board, nodes is increased by the plies played.
+    // A rollout cut after maxPlies, or once the scaled eval reaches adjudication, returns the scaled eval.
+    // The moves are drawn from the feature priors, or from the priors of the board eval.
+    double rollout(const RolloutLeaf& leaf, int maxPlies, double adjudication, bool featurePriors, Thread* th,
+                   ExtMove* moveBuffer, uint64_t& nodes);
+    // Eval in [-1, 1] through a sigmoid, mates to -1 or 1.
+    double scale_eval(Value v);
+
+    // Root parallel search: the most visited move over the roots of all the trees.
+    Move merged_best_move(const std::vector<MCTS_Node*>& roots);
+}
+
+inline double MCTS_Node::value(int child) const {
+    NumVisits visits = numRollouts[child].load(std::memory_order_relaxed);
+    if (visits == 0) {
+        return priors[child]; // very important
+    }
+    double rollouts = Search::leafRollouts ? double(rolloutsSums[child].load(std::memory_order_relaxed)) : 0;
+    double evals = Search::leafEval ? double(evalSums[child].load(std::memory_order_relaxed)) : 0;
+    return ((1 - Search::evalWeight) * rollouts + Search::evalWeight * evals) / (ValueScale * visits);
 }
 
 #endif //SRC_MCTS_H
@@ -0,0 +1,46 @@
+#include <algorithm>
+#include "mcts_arena.h"
+
+MCTS_Arena::~MCTS_Arena() {
+    for (Slab& slab: slabs) {
+        delete[] slab.memory;
+    }
+}
+
+char* MCTS_Arena::next_slab(size_t size, size_t align) {
+    size_t next = 0;
+    if (cursor != nullptr) {
+        usedInFullSlabs += size_t(cursor - slabs[currentSlab].memory);
+        next = currentSlab + 1;
+    }
+
+    // Slabs kept by reset() are reused in order, skipping the ones too small for this request.
+    while (next < slabs.size() && slabs[next].size < size + align) {
+        next++;
+    }
+
+    if (next == slabs.size()) {
+        size_t slabSize = std::max(size_t(SlabSize), size + align);
+        slabs.push_back(Slab{new char[slabSize], slabSize});
+    }
+
+    currentSlab = next;
+    cursor = slabs[next].memory;
+    limit = cursor + slabs[next].size;
+    return align_up(cursor, align);
+}
+
+void MCTS_Arena::reset() {
+    currentSlab = 0;
+    usedInFullSlabs = 0;
+    if (slabs.empty()) {
+        cursor = limit = nullptr;
+    } else {
+        cursor = slabs[0].memory;
+        limit = cursor + slabs[0].size;
+    }
+}
+
+size_t MCTS_Arena::used() const {
+    return cursor == nullptr ? 0 : usedInFullSlabs + size_t(cursor - slabs[currentSlab].memory);
+}
@@ -0,0 +1,63 @@
+#ifndef SRC_MCTS_ARENA_H
+#define SRC_MCTS_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator owning all the memory of an MCTS tree.
+// Memory is handed out of big slabs and is never freed piecewise:
+// reset() releases the whole tree at once and keeps the slabs for the next search.
+// Objects placed in the arena never have their destructors run,
+// so they must not own any memory outside of the arena.
+class MCTS_Arena {
+public:
+    static const size_t SlabSize = 1 << 20;
+
+    MCTS_Arena() : currentSlab(0), cursor(nullptr), limit(nullptr), usedInFullSlabs(0) {}
+    ~MCTS_Arena();
+
+    MCTS_Arena(const MCTS_Arena&) = delete;
+    MCTS_Arena& operator=(const MCTS_Arena&) = delete;
+
+    inline void* allocate(size_t size, size_t align) {
+        char* aligned = align_up(cursor, align);
+        if (aligned + size > limit) {
+            aligned = next_slab(size, align);
+        }
+        cursor = aligned + size;
+        return aligned;
+    }
+
+    template<typename T, typename... Args>
+    T* create(Args&& ... args) {
+        return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // O(number of slabs), no destructor is run.
+    void reset();
+
+    // Bytes handed out since the last reset.
+    size_t used() const;
+
+private:
+    struct Slab {
+        char* memory;
+        size_t size;
+    };
+
+    static inline char* align_up(char* p, size_t align) {
+        return reinterpret_cast<char*>((reinterpret_cast<size_t>(p) + align - 1) & ~(align - 1));
+    }
+
+    char* next_slab(size_t size, size_t align);
+
+    std::vector<Slab> slabs;
+    size_t currentSlab;
+    char* cursor;
+    char* limit;
+    size_t usedInFullSlabs;
+};
+
+#endif //SRC_MCTS_ARENA_H
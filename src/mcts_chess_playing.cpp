@@ -1,17 +1,180 @@
-#include <vector>
+#include <algorithm>
 #include "mcts_chess_playing.h"
 #include "mcts_tablebase.h"
 
+namespace {
+    const int NoRunner = 1000;
+
+    // Moves a pawn needs to promote, with the double step.
+    int moves_to_promote(Color c, Square s) {
+        return RANK_8 - std::max(relative_rank(c, s), RANK_3);
+    }
+
+    int fastest_promotion(const PKBoard& board, Color c) {
+        int fastest = NoRunner;
+        Bitboard b = board.pawns[c];
+        while (b) {
+            Square s = pop_lsb(&b);
+            fastest = std::min(fastest, moves_to_promote(c, s));
+        }
+        return fastest;
+    }
+
+    // Squares the pawns of Us may ever attack. A pawn with something to capture
+    // may change files, all the ranks in front of it are taken then.
+    template<Color Us>
+    Bitboard attack_reach(const PKBoard& board) {
+        Bitboard reach = 0;
+        Bitboard b = board.pawns[Us];
+        while (b) {
+            Square s = pop_lsb(&b);
+            Bitboard span = pawn_attack_span(Us, s);
+            reach |= (span & board.pawns[~Us]) ? in_front_bb(Us, rank_of(s)) : span;
+        }
+        return reach;
+    }
+
+    // Whether the king of Them could find itself stalemated while Us only pushes the runner:
+    // a square out of check with all its neighbours taken. The pawns of Them are counted
+    // on every square they may reach, the pawns of Us as if they could not be taken.
+    template<Color Us>
+    bool may_stalemate(const PKBoard& board, Square runner) {
+        const Color Them = (Us == WHITE ? BLACK : WHITE);
+
+        Bitboard path = forward_bb(Us, runner) | runner;
+        Bitboard attacked = StepAttacksBB[KING][board.kings[Us]] | pawn_attacks<Us>(board.pawns[Us] | path);
+        Bitboard taken = attacked | board.pawns[Us] | path | attack_reach<Them>(board);
+        Bitboard b = board.pawns[Them];
+        while (b) {
+            Square s = pop_lsb(&b);
+            taken |= s | forward_bb(Them, s);
+        }
+
+        Bitboard squares = ~(attacked | board.pawns[Us] | board.kings[Us] | path);
+        while (squares) {
+            Square s = pop_lsb(&squares);
+            if (!(StepAttacksBB[KING][s] & ~taken)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether the king ksq, with tempo extra moves, can neither catch the pawn of Us on s
+    // nor step in front of it before it promotes. The square jumped over by a double step counts too.
+    template<Color Us>
+    bool out_of_reach(Square s, Square ksq, int tempo) {
+        int plies = tempo;
+        for (Square sq = s; ; sq += pawn_push(Us)) {
+            if (distance(ksq, sq) <= plies) {
+                return false;
+            }
+            if (relative_rank(Us, sq) == RANK_8) {
+                return true;
+            }
+            if (relative_rank(Us, sq) != RANK_2) {
+                plies++;
+            }
+        }
+    }
+
+    // Moves the fastest unstoppable pawn of Us needs to promote, NoRunner if there is none.
+    // Us only pushes it: it must be passed with a free path, out of reach of the enemy king
+    // (rule of the square), and Them must neither check the king of Us nor get stalemated.
+    template<Color Us>
+    int unstoppable(const PKBoard& board) {
+        const Color Them = (Us == WHITE ? BLACK : WHITE);
+        const int tempo = board.sideToMove == Us ? 0 : 1;
+
+        if (attack_reach<Them>(board) & board.kings[Us]) {
+            return NoRunner;
+        }
+
+        int fastest = NoRunner;
+        Bitboard b = board.pawns[Us];
+        while (b) {
+            Square s = pop_lsb(&b);
+            int moves = moves_to_promote(Us, s);
+
+            if (moves < fastest
+                && !(board.pawns[Them] & passed_pawn_mask(Us, s))
+                && !(board.occupied() & forward_bb(Us, s))
+                && out_of_reach<Us>(s, board.kings[Them], tempo)
+                && !may_stalemate<Us>(board, s)) {
+                fastest = moves;
+            }
+        }
+        return fastest;
+    }
+}
+
+namespace {
+    Bitboard king_attacks(Bitboard b) {
+        b |= ((b & ~FileHBB) << 1) | ((b & ~FileABB) >> 1);
+        return b | (b << 8) | (b >> 8);
+    }
+
+    // Whether the king of Us can ever take a pawn, with all the pawns standing still:
+    // it walks on the squares out of the attacks of the enemy pawns, the enemy king is ignored.
+    template<Color Us>
+    bool king_can_capture(const PKBoard& board) {
+        const Color Them = (Us == WHITE ? BLACK : WHITE);
+
+        Bitboard defended = pawn_attacks<Them>(board.pawns[Them]);
+        Bitboard safe = ~(defended | board.pawns[WHITE] | board.pawns[BLACK]);
+        Bitboard reach = SquareBB[board.kings[Us]];
+        Bitboard previous = 0;
+        while (reach != previous) {
+            previous = reach;
+            reach |= king_attacks(reach) & safe;
+        }
+
+        return king_attacks(reach) & board.pawns[Them] & ~defended;
+    }
+}
+
+bool isBlocked(const PKBoard& board) {
+    // Every pawn stands in front of a pawn and none can take, so the pawns never move again.
+    Bitboard pawns = board.pawns[WHITE] | board.pawns[BLACK];
+    if ((shift_bb<DELTA_N>(board.pawns[WHITE]) | shift_bb<DELTA_S>(board.pawns[BLACK])) & ~pawns) {
+        return false;
+    }
+    // The en passant square is only set when the pawn can be taken.
+    if ((pawn_attacks<WHITE>(board.pawns[WHITE]) & board.pawns[BLACK])
+        || (pawn_attacks<BLACK>(board.pawns[BLACK]) & board.pawns[WHITE])
+        || board.epSquare != SQ_NONE) {
+        return false;
+    }
+
+    // Without a check, nobody can be mated and only the kings move: the game is dead unless one takes a pawn.
+    return !board.checkers() && !king_can_capture<WHITE>(board) && !king_can_capture<BLACK>(board);
+}
+
+PlayingResult getRaceResult(const PKBoard& board) {
+    const Color us = board.sideToMove, them = ~board.sideToMove;
+
+    // We promote first at equal counts, moving first.
+    if (!board.checkers()) {
+        int ours = us == WHITE ? unstoppable<WHITE>(board) : unstoppable<BLACK>(board);
+        if (ours != NoRunner && fastest_promotion(board, them) >= ours) {
+            return Win;
+        }
+    }
+
+    int theirs = us == WHITE ? unstoppable<BLACK>(board) : unstoppable<WHITE>(board);
+    if (theirs != NoRunner && fastest_promotion(board, us) > theirs) {
+        return Lose;
+    }
+
+    return ContinueGame;
+}
+
 
 Bitboard promotedPieces(Position& pos) {
     return pos.pieces() & ~pos.pieces(PAWN) & ~pos.pieces(KING);
 }
 
-PlayingResult getGameResult(Position& pos, int numMoves) {
-    PlayingResult res;
-    if (isInTableBase(pos, &res))
-        return res;
-
+PlayingResult getPromotionResult(Position& pos) {
     Bitboard promoted = promotedPieces(pos);
     Color sideToMove = pos.side_to_move();
     Bitboard ourPromoted = pos.pieces(sideToMove) & promoted;
@@ -21,6 +184,17 @@ PlayingResult getGameResult(Position& pos, int numMoves) {
     if (promoted /*&& !ourPromoted*/) {
         return Lose;
     }
+    return ContinueGame;
+}
+
+PlayingResult getGameResult(Position& pos, int numMoves) {
+    PlayingResult res;
+    if (isInTableBase(pos, &res))
+        return res;
+
+    res = getPromotionResult(pos);
+    if (res != ContinueGame)
+        return res;
 
     if (numMoves == 0) {
         if (pos.checkers())
@@ -31,18 +205,27 @@ PlayingResult getGameResult(Position& pos, int numMoves) {
 
     if (pos.is_draw())
         return Tie;
-    return ContinueGame;
-}
 
-int getNumMoves(Position& pos, ExtMove* buffer) {
-    ExtMove* end = generate<LEGAL>(pos, buffer);
-    return countValidMoves(buffer, int(end - buffer));
+    PKBoard board;
+    board.set(pos);
+    if (isBlocked(board))
+        return Tie;
+    return getRaceResult(board);
 }
 
-int countValidMoves(ExtMove* moves, int maxSize) {
-    int i = 0;
-    while (i < maxSize && moves[i] != MOVE_NONE) {
-        i++;
+PlayingResult getGameResult(const PKBoard& board, int numMoves, Thread* th) {
+    PlayingResult res;
+    if (isInTableBase(board, th, &res))
+        return res;
+
+    if (numMoves == 0) {
+        if (board.checkers())
+            return Lose;
+        else
+            return Tie;
     }
-    return i;
-}
\ No newline at end of file
+
+    if (board.is_draw() || isBlocked(board))
+        return Tie;
+    return getRaceResult(board);
+}
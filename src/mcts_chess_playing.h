@@ -3,6 +3,7 @@
 
 #include "position.h"
 #include "movegen.h"
+#include "mcts_pkboard.h"
 
 enum PlayingResult {
     ContinueGame = 2,
@@ -12,8 +13,14 @@ enum PlayingResult {
 };
 
 PlayingResult getGameResult(Position& pos, int numMoves);
+// The promotions are left to the caller, a board never holds a promoted piece.
+PlayingResult getGameResult(const PKBoard& board, int numMoves, Thread* th);
+// Win or Lose once a pawn has promoted, ContinueGame otherwise.
+PlayingResult getPromotionResult(Position& pos);
 Bitboard promotedPieces(Position& pos);
-int getNumMoves(Position& pos, ExtMove* buffer);
-int countValidMoves(ExtMove* moves, int maxSize);
+// Dead positions: the pawns are locked and no king can ever take one.
+bool isBlocked(const PKBoard& board);
+// Win or Lose once a pawn race is decided, a conservative guess: ContinueGame when in doubt.
+PlayingResult getRaceResult(const PKBoard& board);
 
 #endif //SRC_MCTS_CHESS_PLAYING_H
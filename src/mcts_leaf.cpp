@@ -0,0 +1,121 @@
+#include <algorithm>
+#include "mcts_leaf.h"
+#include "mcts.h"
+#include "thread.h"
+
+MCTS_LeafRollouts LeafRollouts; // Global object
+
+PlayingResult RolloutLeaf::set(Position& pos) {
+    // The promotions and the repetitions of the game are seen on pos, the rest on the board.
+    PlayingResult result = getPromotionResult(pos);
+    if (result != ContinueGame) {
+        return result;
+    }
+
+    board.set(pos);
+    numMoves = int(board.generate(moves) - moves);
+    result = getGameResult(board, numMoves, pos.this_thread());
+    if (result == ContinueGame && pos.is_draw()) {
+        result = Tie;
+    }
+
+    return result;
+}
+
+void RolloutLeaf::calc_priors(bool featurePriors) {
+    numMoves = int(decisive_moves(board, moves, moves + numMoves) - moves);
+    if (featurePriors) {
+        calc_feature_priors(board, moves, numMoves);
+    } else {
+        ::calc_priors(board, moves, numMoves);
+    }
+}
+
+void MCTS_LeafRollouts::start(int rolloutsPerLeaf, int numWorkers, int rolloutPlies, double adjudicationLimit,
+                              bool useFeaturePriors) {
+    std::lock_guard<Mutex> lock(mutex);
+    count = rolloutsPerLeaf;
+    workers = numWorkers;
+    plies = rolloutPlies;
+    adjudication = adjudicationLimit;
+    featurePriors = useFeaturePriors;
+    stopped = false;
+    next = count; // Nothing to hand out until the first leaf
+}
+
+void MCTS_LeafRollouts::stop() {
+    std::lock_guard<Mutex> lock(mutex);
+    stopped = true;
+    sleepCondition.notify_all();
+}
+
+double MCTS_LeafRollouts::run(Position& pos, const RolloutLeaf& rolloutLeaf, int maxPlies, ExtMove* moveBuffer) {
+    maxPlies = std::min(maxPlies, plies);
+
+    if (workers == 0) {
+        double result = 0;
+        uint64_t nodes = 0;
+        for (int i = 0; i < count; i++) {
+            result += Search::rollout(rolloutLeaf, maxPlies, adjudication, featurePriors, pos.this_thread(),
+                                      moveBuffer, nodes);
+        }
+        pos.set_nodes_searched(pos.nodes_searched() + nodes);
+        return result;
+    }
+
+    // The leaf is left untouched until all the rollouts are done, the helpers play from it.
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        leaf = &rolloutLeaf;
+        leafPlies = maxPlies;
+        done = 0;
+        sum = 0;
+        next = 0;
+        generation++;
+        sleepCondition.notify_all();
+    }
+
+    uint64_t nodes = take_rollouts(pos.this_thread());
+
+    std::unique_lock<Mutex> lock(mutex);
+    sleepCondition.wait(lock, [&] { return done == count; });
+    pos.set_nodes_searched(pos.nodes_searched() + nodes);
+    return sum;
+}
+
+void MCTS_LeafRollouts::work(Thread* th) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<Mutex> lock(mutex);
+            sleepCondition.wait(lock, [&] { return stopped || generation != seen; });
+            if (stopped) {
+                return;
+            }
+            seen = generation;
+        }
+
+        uint64_t nodes = take_rollouts(th);
+        th->rootPos.set_nodes_searched(th->rootPos.nodes_searched() + nodes);
+    }
+}
+
+uint64_t MCTS_LeafRollouts::take_rollouts(Thread* th) {
+    ExtMove moveBuffer[MAX_MOVES];
+    uint64_t nodes = 0;
+
+    // The leaf is read once the rollout is handed out: once the last one is done, run() returns
+    // and the next rollout handed out may already belong to another leaf.
+    while (next++ < count) {
+        double result = Search::rollout(*leaf, leafPlies, adjudication, featurePriors, th, moveBuffer,
+                                            nodes);
+
+        std::lock_guard<Mutex> lock(mutex);
+        sum += result;
+        if (++done == count) {
+            sleepCondition.notify_all();
+        }
+    }
+
+    return nodes;
+}
@@ -0,0 +1,82 @@
+#ifndef SRC_MCTS_LEAF_H
+#define SRC_MCTS_LEAF_H
+
+#include <atomic>
+#include "mcts_chess_playing.h"
+#include "mcts_pkboard.h"
+#include "movegen.h"
+#include "position.h"
+#include "thread_win32.h"
+
+class Thread;
+
+// Position the rollouts of an iteration start from, its legal moves and their priors are computed once.
+struct RolloutLeaf {
+    PKBoard board;
+    ExtMove moves[MAX_MOVES];
+    int numMoves;
+
+    // The result of the game at pos, the leaf is only set if the game goes on.
+    PlayingResult set(Position& pos);
+
+    // Priors of the rollout policy, before the rollouts are played from the leaf.
+    void calc_priors(bool featurePriors);
+};
+
+// Leaf parallel search: every leaf gets several rollouts, and their results are backed up at once.
+// With helper threads, the main thread hands the rollouts of a leaf out to them
+// and takes its part, the rollouts are played from the pawns and kings board of the leaf.
+class MCTS_LeafRollouts {
+public:
+    MCTS_LeafRollouts() : count(1), workers(0), plies(MAX_PLY), adjudication(1), featurePriors(false), leaf(nullptr),
+                          leafPlies(0), generation(0), stopped(false), next(0), done(0), sum(0) {}
+
+    // Called by the main thread before the helpers are started. The rollouts are cut after rolloutPlies,
+    // or once the scaled eval reaches adjudication (1 never cuts). With featurePriors the rollout moves
+    // are drawn from the features of the board instead of the eval of every child.
+    void start(int rolloutsPerLeaf, int numWorkers, int rolloutPlies, double adjudication, bool featurePriors);
+
+    // Called by the main thread once the search is over, makes the helpers return from work().
+    void stop();
+
+    int rollouts_per_leaf() const {
+        return count;
+    }
+
+    bool feature_priors() const {
+        return featurePriors;
+    }
+
+    // Sum of the results of the rollouts from the leaf set from pos, from the point of view of the side to move.
+    double run(Position& pos, const RolloutLeaf& rolloutLeaf, int maxPlies, ExtMove* moveBuffer);
+
+    // Loop of the helper threads, plays the rollouts handed out by run().
+    void work(Thread* th);
+
+private:
+    // Plies played in the rollouts taken.
+    uint64_t take_rollouts(Thread* th);
+
+    int count;
+    int workers;
+    int plies;
+    double adjudication;
+    bool featurePriors;
+
+    Mutex mutex;
+    ConditionVariable sleepCondition;
+
+    // The current leaf, published under the mutex
+    const RolloutLeaf* leaf;
+    int leafPlies; // Plies left before MAX_PLY
+    uint64_t generation;
+    bool stopped;
+
+    std::atomic<int> next; // Next rollout of the leaf to be handed out
+    int done; // Under the mutex
+    double sum;
+};
+
+extern MCTS_LeafRollouts LeafRollouts;
+
+#endif //SRC_MCTS_LEAF_H
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <sstream>
+#include "bitcount.h"
+#include "mcts_pkboard.h"
+
+namespace Zobrist {
+    extern Key psq[COLOR_NB][PIECE_TYPE_NB][SQUARE_NB];
+    extern Key enpassant[FILE_NB];
+    extern Key side;
+}
+
+namespace {
+    // Endgame halves of the passed pawn bonuses of evaluate.cpp
+    const int PassedEg[RANK_NB] = {7, 14, 37, 63, 134, 189};
+    const int PassedFileEg[FILE_NB] = {10, 10, -8, -12, -12, -8, 10, 10};
+    const int PassedPawnsWeightEg = 262;
+
+    template<Square Delta>
+    ExtMove* make_pawn_moves(Bitboard to, ExtMove* moves) {
+        const Bitboard promotionRanks = Rank1BB | Rank8BB;
+        while (to) {
+            Square s = pop_lsb(&to);
+            if (promotionRanks & s) {
+                *moves++ = make<PROMOTION>(s - Delta, s, QUEEN);
+            } else {
+                *moves++ = make_move(s - Delta, s);
+            }
+        }
+        return moves;
+    }
+
+    template<Color Us>
+    ExtMove* generate_moves(const PKBoard& board, ExtMove* moves) {
+        const Color Them = (Us == WHITE ? BLACK : WHITE);
+        const Square Up = (Us == WHITE ? DELTA_N : DELTA_S);
+        const Square Right = (Us == WHITE ? DELTA_NE : DELTA_SW);
+        const Square Left = (Us == WHITE ? DELTA_NW : DELTA_SE);
+        const Bitboard TRank3BB = (Us == WHITE ? Rank3BB : Rank6BB);
+
+        const Square ksq = board.kings[Us];
+        const Bitboard empty = ~board.occupied();
+        const Bitboard checkers = board.checkers();
+
+        // Without sliders nothing is pinned: only the king has to stay out of the attacks.
+        Bitboard b = StepAttacksBB[KING][ksq] & ~board.pawns[Us] & ~StepAttacksBB[KING][board.kings[Them]]
+                     & ~pawn_attacks<Them>(board.pawns[Them]);
+        while (b) {
+            *moves++ = make_move(ksq, pop_lsb(&b));
+        }
+
+        // A pawn check is never a double check and cannot be blocked, the checker has to be captured.
+        Bitboard pushTargets = checkers ? 0 : empty;
+        Bitboard captureTargets = checkers ? checkers : board.pawns[Them];
+
+        Bitboard single = shift_bb<Up>(board.pawns[Us]) & empty;
+        Bitboard twice = shift_bb<Up>(single & TRank3BB) & pushTargets;
+        moves = make_pawn_moves<Up>(single & pushTargets, moves);
+        while (twice) {
+            Square to = pop_lsb(&twice);
+            *moves++ = make_move(to - Up - Up, to);
+        }
+        moves = make_pawn_moves<Right>(shift_bb<Right>(board.pawns[Us]) & captureTargets, moves);
+        moves = make_pawn_moves<Left>(shift_bb<Left>(board.pawns[Us]) & captureTargets, moves);
+
+        if (board.epSquare != SQ_NONE && (!checkers || (checkers & (board.epSquare - Up)))) {
+            b = board.pawns[Us] & StepAttacksBB[make_piece(Them, PAWN)][board.epSquare];
+            while (b) {
+                *moves++ = make<ENPASSANT>(pop_lsb(&b), board.epSquare);
+            }
+        }
+
+        return moves;
+    }
+
+    template<Color Us>
+    int passed_pawns(const PKBoard& board) {
+        const Color Them = (Us == WHITE ? BLACK : WHITE);
+
+        const Bitboard defended = pawn_attacks<Us>(board.pawns[Us]) | StepAttacksBB[KING][board.kings[Us]];
+        const Bitboard attacked = pawn_attacks<Them>(board.pawns[Them]) | StepAttacksBB[KING][board.kings[Them]];
+
+        int bonus = 0;
+        Bitboard b = board.pawns[Us];
+        while (b) {
+            Square s = pop_lsb(&b);
+            if (board.pawns[Them] & passed_pawn_mask(Us, s)) {
+                continue;
+            }
+
+            int r = relative_rank(Us, s) - RANK_2;
+            int rr = r * (r - 1);
+            int ebonus = PassedEg[r];
+
+            if (rr) {
+                Square blockSq = s + pawn_push(Us);
+
+                // King proximity
+                ebonus += distance(board.kings[Them], blockSq) * 5 * rr
+                          - distance(board.kings[Us], blockSq) * 2 * rr;
+                if (relative_rank(Us, blockSq) != RANK_8) {
+                    ebonus -= distance(board.kings[Us], blockSq + pawn_push(Us)) * rr;
+                }
+
+                // Free path to the queening square
+                if (!(board.occupied() & blockSq)) {
+                    Bitboard squaresToQueen = forward_bb(Us, s);
+                    Bitboard unsafeSquares = squaresToQueen & (attacked | board.pawns[Them] | board.kings[Them]);
+                    Bitboard defendedSquares = squaresToQueen & defended;
+
+                    int k = !unsafeSquares ? 18 : !(unsafeSquares & blockSq) ? 8 : 0;
+                    if (defendedSquares == squaresToQueen) {
+                        k += 6;
+                    } else if (defendedSquares & blockSq) {
+                        k += 4;
+                    }
+                    ebonus += k * rr;
+                } else if (board.pawns[Us] & blockSq) {
+                    ebonus += rr + r * 2;
+                }
+            }
+
+            if (popcount<Max15>(board.pawns[Us]) < popcount<Max15>(board.pawns[Them])) {
+                ebonus += ebonus / 4;
+            }
+
+            bonus += ebonus + PassedFileEg[file_of(s)];
+        }
+
+        return bonus * PassedPawnsWeightEg / 256;
+    }
+}
+
+void PKBoard::set(const Position& pos) {
+    assert(pos.pieces() == pos.pieces(PAWN, KING));
+
+    for (Color c = WHITE; c <= BLACK; ++c) {
+        pawns[c] = pos.pieces(c, PAWN);
+        kings[c] = pos.square<KING>(c);
+    }
+    sideToMove = pos.side_to_move();
+    epSquare = pos.ep_square();
+    rule50 = pos.rule50_count();
+    key = pos.key();
+    previous = nullptr;
+}
+
+void PKBoard::do_move(Move m, PKBoard& next) const {
+    const Color us = sideToMove, them = ~sideToMove;
+    const Square from = from_sq(m), to = to_sq(m);
+
+    next = *this;
+    next.previous = this;
+    next.sideToMove = them;
+    next.rule50++;
+    next.key ^= Zobrist::side;
+
+    if (epSquare != SQ_NONE) {
+        next.key ^= Zobrist::enpassant[file_of(epSquare)];
+        next.epSquare = SQ_NONE;
+    }
+
+    if (type_of(m) == ENPASSANT) {
+        Square capsq = to - pawn_push(us);
+        next.pawns[them] ^= capsq;
+        next.key ^= Zobrist::psq[them][PAWN][capsq];
+    } else if (pawns[them] & to) {
+        next.pawns[them] ^= to;
+        next.key ^= Zobrist::psq[them][PAWN][to];
+        next.rule50 = 0;
+    }
+
+    if (from == kings[us]) {
+        next.kings[us] = to;
+        next.key ^= Zobrist::psq[us][KING][from] ^ Zobrist::psq[us][KING][to];
+        return;
+    }
+
+    next.rule50 = 0;
+    next.pawns[us] ^= from;
+    next.key ^= Zobrist::psq[us][PAWN][from];
+
+    if (type_of(m) == PROMOTION) {
+        next.key ^= Zobrist::psq[us][promotion_type(m)][to];
+        return;
+    }
+
+    next.pawns[us] ^= to;
+    next.key ^= Zobrist::psq[us][PAWN][to];
+
+    // Like Position, the en passant square is only set when the pawn can be taken.
+    if ((int(to) ^ int(from)) == 16 && (StepAttacksBB[make_piece(us, PAWN)][to - pawn_push(us)] & pawns[them])) {
+        next.epSquare = (from + to) / 2;
+        next.key ^= Zobrist::enpassant[file_of(next.epSquare)];
+    }
+}
+
+ExtMove* PKBoard::generate(ExtMove* moves) const {
+    return sideToMove == WHITE ? generate_moves<WHITE>(*this, moves) : generate_moves<BLACK>(*this, moves);
+}
+
+Value PKBoard::evaluate() const {
+    Score psq = PSQT::psq[WHITE][KING][kings[WHITE]] + PSQT::psq[BLACK][KING][kings[BLACK]];
+    for (Color c = WHITE; c <= BLACK; ++c) {
+        Bitboard b = pawns[c];
+        while (b) {
+            psq += PSQT::psq[c][PAWN][pop_lsb(&b)];
+        }
+    }
+
+    Value v = eg_value(psq) + Value(passed_pawns<WHITE>(*this) - passed_pawns<BLACK>(*this));
+    return sideToMove == WHITE ? v : -v;
+}
+
+Bitboard PKBoard::checkers() const {
+    return StepAttacksBB[make_piece(sideToMove, PAWN)][kings[sideToMove]] & pawns[~sideToMove];
+}
+
+bool PKBoard::can_promote() const {
+    Bitboard pushes = sideToMove == WHITE ? shift_bb<DELTA_N>(pawns[WHITE] & Rank7BB)
+                                          : shift_bb<DELTA_S>(pawns[BLACK] & Rank2BB);
+    return (pushes & ~occupied()) && !checkers();
+}
+
+bool PKBoard::is_draw() const {
+    // The mates are found before, from the number of legal moves.
+    if (rule50 > 99) {
+        return true;
+    }
+
+    const PKBoard* board = this;
+    for (int i = 2; i <= rule50 && board->previous && board->previous->previous; i += 2) {
+        board = board->previous->previous;
+        if (board->key == key) {
+            return true; // Draw at first repetition
+        }
+    }
+
+    return false;
+}
+
+int PKBoard::piece_count() const {
+    return popcount<Full>(pawns[WHITE] | pawns[BLACK]) + 2;
+}
+
+std::string PKBoard::fen() const {
+    std::ostringstream ss;
+
+    for (Rank r = RANK_8; r >= RANK_1; --r) {
+        int emptyCnt = 0;
+        for (File f = FILE_A; f <= FILE_H; ++f) {
+            Square s = make_square(f, r);
+            char c = pawns[WHITE] & s ? 'P' : pawns[BLACK] & s ? 'p' : s == kings[WHITE] ? 'K' : s == kings[BLACK] ? 'k' : 0;
+            if (!c) {
+                emptyCnt++;
+                continue;
+            }
+            if (emptyCnt) {
+                ss << emptyCnt;
+                emptyCnt = 0;
+            }
+            ss << c;
+        }
+        if (emptyCnt) {
+            ss << emptyCnt;
+        }
+        if (r > RANK_1) {
+            ss << '/';
+        }
+    }
+
+    ss << (sideToMove == WHITE ? " w - " : " b - ");
+    if (epSquare != SQ_NONE) {
+        ss << char('a' + file_of(epSquare)) << char('1' + rank_of(epSquare));
+    } else {
+        ss << '-';
+    }
+    ss << ' ' << rule50 << " 1";
+
+    return ss.str();
+}
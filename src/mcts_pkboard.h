@@ -0,0 +1,51 @@
+#ifndef SRC_MCTS_PKBOARD_H
+#define SRC_MCTS_PKBOARD_H
+
+#include <string>
+#include "movegen.h"
+#include "position.h"
+
+// Board of the rollouts: a Peshka game in progress only has pawns and kings, the first promotion ends it.
+// Moves are made by copying the board (copy-make), there is no undo_move and no StateInfo chain.
+// The keys are the Position keys, the previous boards are kept alive by the caller for the repetitions.
+struct PKBoard {
+    Bitboard pawns[COLOR_NB];
+    Square kings[COLOR_NB];
+    Color sideToMove;
+    Square epSquare;
+    int rule50;
+    Key key;
+    const PKBoard* previous;
+
+    // pos must only have pawns and kings.
+    void set(const Position& pos);
+
+    // Promotions leave the promoted piece out of the board: the game is over.
+    void do_move(Move m, PKBoard& next) const;
+
+    // Legal moves, the promotions are to a queen only.
+    ExtMove* generate(ExtMove* moves) const;
+
+    // From the point of view of the side to move.
+    Value evaluate() const;
+
+    Bitboard checkers() const;
+    // Whether the side to move can promote at once. In check it cannot: a push never answers a pawn check.
+    bool can_promote() const;
+    bool is_draw() const;
+    int piece_count() const;
+    std::string fen() const;
+
+    Bitboard occupied() const {
+        return pawns[WHITE] | pawns[BLACK] | kings[WHITE] | kings[BLACK];
+    }
+};
+
+// Squares attacked by the pawns of color Us.
+template<Color Us>
+inline Bitboard pawn_attacks(Bitboard pawns) {
+    return Us == WHITE ? shift_bb<DELTA_NE>(pawns) | shift_bb<DELTA_NW>(pawns)
+                       : shift_bb<DELTA_SE>(pawns) | shift_bb<DELTA_SW>(pawns);
+}
+
+#endif //SRC_MCTS_PKBOARD_H
@@ -1,145 +1,390 @@
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
-#include <chrono>
-#include <random>
 #include <iostream>
 #include "mcts_prior.h"
 #include "evaluate.h"
 #include "position.h"
 #include "mcts_chess_playing.h"
 #include "mcts.h"
+#include "thread.h"
 
-std::ranlux24 getGenerator();
+#ifdef USE_AVX2
+#include <immintrin.h>
+#endif
+
+Value EvalCache::evaluate(const Position& pos) {
+    Entry* e = pos.this_thread()->evalCache[pos.key()];
+    if (e->key != pos.key()) {
+        e->key = pos.key();
+        // Until the first promotion, which ends the game, there are only pawns and kings.
+        e->value = pos.pieces() == pos.pieces(PAWN, KING) ? Eval::evaluate<false, Eval::PawnsAndKingsOnly>(pos)
+                                                          : Eval::evaluate(pos);
+    }
+    return e->value;
+}
 
 Value safeEval(Position& pos, Move move /*player*/, CheckInfo& ci /*already computed for pos*/, StateInfo& st) {
+    // From the point of view of the moving player.
     bool isCheck = pos.gives_check(move, ci); // moving player gave check.
-    if (isCheck) {
-        pos.do_move(move, st, isCheck);
-        Value deepEval = qeval(pos);
-        pos.undo_move(move);
-        return -deepEval;
-    } else {
-        pos.do_move(move, st, isCheck);
-        Value eval = Eval::evaluate<false>(pos);
-        pos.undo_move(move);
-        return eval;
+    pos.do_move(move, st, isCheck);
+    Value eval = isCheck ? qeval(pos) : EvalCache::evaluate(pos);
+    pos.undo_move(move);
+    return -eval;
+}
+
+namespace {
+    // Probes the eval cache for the qeval of a position in check, which has no static eval of its own.
+    bool probe_qeval(const Position& pos, Value& value) {
+        EvalCache::Entry* e = pos.this_thread()->evalCache[pos.key()];
+        if (e->key != pos.key()) {
+            return false;
+        }
+        value = e->value;
+        return true;
+    }
+
+    void store_qeval(const Position& pos, Value value) {
+        EvalCache::Entry* e = pos.this_thread()->evalCache[pos.key()];
+        e->key = pos.key();
+        e->value = value;
+    }
+
+    // Generates the evasions of the position in check, with whether they give check in their value.
+    void open_frame(Position& pos, QevalStack::Frame& frame) {
+        CheckInfo ci(pos);
+        frame.current = frame.moves;
+        frame.end = generate<LEGAL>(pos, frame.moves);
+        for (ExtMove* m = frame.moves; m != frame.end; m++) {
+            m->value = Value(pos.gives_check(m->move, ci));
+        }
+        // Mate, we don't have moves, we lost.
+        frame.best = frame.moves == frame.end ? -VALUE_MATE : -VALUE_INFINITE;
     }
 }
 
+// The best of the evasions while in check, the evasions giving check are searched in turn.
+// Iterative: every position in check down the line is a frame of the thread's stack, at most MaxPly deep.
+// Beyond it the position in check is scored a draw, as the search does at MAX_PLY.
 Value qeval(Position& pos) {
     if (!pos.checkers()) {
-        return Eval::evaluate(pos);
+        return EvalCache::evaluate(pos);
     }
 
-    ExtMove evasionsBuffer[16];
-    
-    StateInfo st;
-    CheckInfo ci(pos);
+    Value value;
+    if (probe_qeval(pos, value)) {
+        return value;
+    }
 
-    ExtMove* evasions = evasionsBuffer;
-    ExtMove* end = generate<LEGAL>(pos, evasions);
+    QevalStack::Frame* frames = pos.this_thread()->qevalStack.frames;
+    int ply = 0;
+    open_frame(pos, frames[0]);
 
-    if (evasions == end) {
-        // Mate, we don't have moves, we lost.
-        return -VALUE_MATE;
-    }
+    while (true) {
+        QevalStack::Frame& frame = frames[ply];
+
+        if (frame.current != frame.end) {
+            const ExtMove& move = *frame.current++;
+            const bool isCheck = move.value;
+            pos.do_move(move, frame.st, isCheck);
 
-    Value bestValue = -VALUE_INFINITE;
-    while (evasions != end && *evasions != MOVE_NONE) {
-        // rec on the move, max.
-        Value currentValue;
+            if (!isCheck) {
+                value = EvalCache::evaluate(pos);
+            } else if (!probe_qeval(pos, value)) {
+                if (ply + 1 < QevalStack::MaxPly) {
+                    open_frame(pos, frames[++ply]);
+                    continue;
+                }
+                value = VALUE_DRAW;
+            }
 
-        bool isCheck = pos.gives_check(*evasions, ci);
-        pos.do_move(*evasions, st, isCheck);
-        if (!isCheck) {
-             currentValue = Eval::evaluate<false>(pos);
-        } else {
-            currentValue = -qeval(pos);
+            pos.undo_move(move);
+            frame.best = std::max(frame.best, -value);
+            continue;
         }
-        pos.undo_move(*evasions);
 
-        if (currentValue > bestValue) {
-            bestValue = currentValue;
+        // All the evasions are tried, back up to the position before.
+        store_qeval(pos, frame.best);
+        if (ply == 0) {
+            return frame.best;
         }
 
-        evasions++;
+        QevalStack::Frame& parent = frames[--ply];
+        pos.undo_move(parent.current[-1]);
+        parent.best = std::max(parent.best, -frame.best);
     }
-
-    return bestValue;
 }
 
 
-// e^(x/t - max)
-void calc_exp_evals(Position& pos, ExtMove* moves, int size) {
-    StateInfo st;
-    CheckInfo ci(pos);
+namespace {
+#ifdef USE_AVX2
+    // e^x for x <= 0: x = n ln2 + r, and e^r from the polynomial of Cephes' expf, within 2 ulp.
+    inline __m256 exp_ps(__m256 x) {
+        x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f)); // 2^n stays a normal float
+        __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+        r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
 
-    int count = 0;
-    for (int i = 0; i < size && moves[i] != MOVE_NONE; i++, count++) {
-        // calculate move values (heuristics)
-        Value eval = safeEval(pos, moves[i], ci, st);
-        moves[i].setPrior(float(eval) / Search::normalizationFactor);
+        __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+        __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+    }
+
+    inline float max_ps(__m256 v) {
+        __m128 h = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+        return _mm_cvtss_f32(_mm_max_ss(h, _mm_shuffle_ps(h, h, 1)));
+    }
+
+    inline float sum_ps(__m256 v) {
+        __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+        return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
     }
 
-    float max = -VALUE_INFINITE;
-    for (int i = 0; i < count; i++) {
-        max = std::max(max, moves[i].getPrior());
+    // Softmax of the scores in place. The scores are 32 bytes aligned, with room up to a multiple of 8:
+    // the padding gets e^-87, which vanishes next to the e^0 of the best score.
+    void softmax(float* scores, int size) {
+        const int end = (size + 7) & ~7;
+        std::fill(scores + size, scores + end, -FLT_MAX);
+
+        __m256 vmax = _mm256_set1_ps(-FLT_MAX);
+        for (int i = 0; i < end; i += 8) {
+            vmax = _mm256_max_ps(vmax, _mm256_load_ps(scores + i));
+        }
+        vmax = _mm256_set1_ps(max_ps(vmax));
+
+        __m256 vsum = _mm256_setzero_ps();
+        for (int i = 0; i < end; i += 8) {
+            __m256 e = exp_ps(_mm256_sub_ps(_mm256_load_ps(scores + i), vmax));
+            _mm256_store_ps(scores + i, e);
+            vsum = _mm256_add_ps(vsum, e);
+        }
+
+        const __m256 inverse = _mm256_set1_ps(1 / sum_ps(vsum));
+        for (int i = 0; i < end; i += 8) {
+            _mm256_store_ps(scores + i, _mm256_mul_ps(_mm256_load_ps(scores + i), inverse));
+        }
     }
+#else
+    // Softmax of the scores in place.
+    void softmax(float* scores, int size) {
+        float max = -FLT_MAX;
+        for (int i = 0; i < size; i++) {
+            max = std::max(max, scores[i]);
+        }
+
+        double expSum = 0;
+        for (int i = 0; i < size; i++) {
+            scores[i] = std::exp(scores[i] - max);
+            expSum += scores[i];
+        }
 
-    for (int i = 0; i < count; i++) {
-        float eval = std::exp(moves[i].getPrior() - max);
-        moves[i].setPrior(eval);
+        for (int i = 0; i < size; i++) {
+            scores[i] = float(scores[i] / expSum);
+        }
     }
+#endif
 
+    // The priors are the softmax of the scores.
+    void set_priors(ExtMove* moves, float* scores, int size) {
+        softmax(scores, size);
+        for (int i = 0; i < size; i++) {
+            moves[i].setPrior(scores[i]);
+        }
+    }
 }
 
 void calc_priors(Position& pos, ExtMove* moves, int size) {
-    // e^(x/t - max) / sum
-    calc_exp_evals(pos, moves, size);
+    StateInfo st;
+    CheckInfo ci(pos);
+    Thread* th = pos.this_thread();
+    alignas(32) float scores[MAX_MOVES];
 
-    double expSum = 0;
+    // The eval cache and pawns table entries of all the children are fetched first,
+    // so that the misses overlap instead of stalling every evaluation in turn.
     for (int i = 0; i < size; i++) {
-        expSum += moves[i].getPrior();
+        prefetch(th->evalCache[pos.key_after(moves[i])]);
+        prefetch(th->pawnsTable[pos.pawn_key_after(moves[i])]);
     }
 
     for (int i = 0; i < size; i++) {
-        moves[i].setPrior(float(moves[i].getPrior() / expSum));
+        // calculate move values (heuristics)
+        scores[i] = float(safeEval(pos, moves[i], ci, st)) / Search::normalizationFactor;
     }
+
+    set_priors(moves, scores, size);
 }
 
-std::ranlux24 getGenerator() {
-    long long int seed = std::chrono::system_clock::now().time_since_epoch().count();
-    return std::ranlux24(seed);
+void calc_priors(const PKBoard& board, ExtMove* moves, int size) {
+    // Scored from the point of view of the mover, a promotion wins the game.
+    PKBoard next;
+    alignas(32) float scores[MAX_MOVES];
+    for (int i = 0; i < size; i++) {
+        Value eval = VALUE_KNOWN_WIN;
+        if (type_of(moves[i]) != PROMOTION) {
+            board.do_move(moves[i], next);
+            eval = -next.evaluate();
+        }
+        scores[i] = float(eval) / Search::normalizationFactor;
+    }
+
+    set_priors(moves, scores, size);
 }
 
-Move sampleMove(Position& pos, ExtMove* moves) {
-    auto generator = getGenerator();
-    std::uniform_real_distribution<float> distribution(0.0, 1.0);
+namespace {
+    // Features of the rollout policy, in the units of the eval. The bonuses are by relative rank of the destination.
+    const int PushBonus[RANK_NB] = {0, 0, 0, 5, 10, 20, 40, 0};
+    const int PassedPushBonus[RANK_NB] = {0, 0, 0, 20, 40, 80, 160, 0};
+    const int PromotionThreat = 200; // A free push to the 7th rank
+    const int CaptureBonus = 150;
+    const int PassedCaptureBonus = 150; // On top of CaptureBonus
+    const int HangingPenalty = 120; // Moving a pawn to a square attacked and not defended
+    const int KingApproach = 25; // For each square closer to the nearest passed pawn
 
-    float stopPoint = distribution(generator);
+    bool is_passed(const PKBoard& board, Color c, Square s) {
+        return !(board.pawns[~c] & passed_pawn_mask(c, s));
+    }
 
-    float partialSum = 0;
-    int i = 0;
-    while (partialSum <= stopPoint) {
-        partialSum += moves[i].getPrior();
-        i++;
+    int distance_to(Bitboard targets, Square s) {
+        int d = 8;
+        while (targets) {
+            d = std::min(d, distance(s, pop_lsb(&targets)));
+        }
+        return d;
     }
 
-    return moves[i - 1];
+    template<Color Us>
+    void score_features(const PKBoard& board, const ExtMove* moves, int size, float* scores) {
+        const Color Them = (Us == WHITE ? BLACK : WHITE);
+        const Square Up = (Us == WHITE ? DELTA_N : DELTA_S);
+
+        const Bitboard attacked = pawn_attacks<Them>(board.pawns[Them]) | StepAttacksBB[KING][board.kings[Them]];
+        const Bitboard kingDefended = StepAttacksBB[KING][board.kings[Us]];
+
+        // The king heads for the passed pawns, to push its own or stop the opponent's, or else for any pawn.
+        Bitboard targets = 0;
+        for (Color c = WHITE; c <= BLACK; ++c) {
+            Bitboard b = board.pawns[c];
+            while (b) {
+                Square s = pop_lsb(&b);
+                if (is_passed(board, c, s)) {
+                    targets |= s;
+                }
+            }
+        }
+        if (!targets) {
+            targets = board.pawns[WHITE] | board.pawns[BLACK];
+        }
+
+        for (int i = 0; i < size; i++) {
+            const Move m = moves[i];
+            const Square from = from_sq(m), to = to_sq(m);
+            const Square captured = type_of(m) == ENPASSANT ? to - Up : to;
+
+            int score = 0;
+            if (board.pawns[Them] & captured) {
+                score += CaptureBonus;
+                if (is_passed(board, Them, captured)) {
+                    score += PassedCaptureBonus;
+                }
+            }
+
+            if (type_of(m) == PROMOTION) {
+                score = VALUE_KNOWN_WIN;
+            } else if (from == board.kings[Us]) {
+                score += KingApproach * (distance_to(targets, from) - distance_to(targets, to));
+            } else {
+                const Rank r = relative_rank(Us, to);
+                score += is_passed(board, Us, from) ? PassedPushBonus[r] : PushBonus[r];
+                if (r == RANK_7 && !(board.occupied() & (to + Up))) {
+                    score += PromotionThreat;
+                }
+
+                // The pawn does not defend the square it moves to.
+                const Bitboard defended = pawn_attacks<Us>(board.pawns[Us] ^ from) | kingDefended;
+                if ((attacked & to) && !(defended & to)) {
+                    score -= HangingPenalty;
+                }
+            }
+
+            scores[i] = float(score) / Search::normalizationFactor;
+        }
+    }
 }
 
-UnopenedMove sampleMove(Position& pos, UnopenedMove* moves, int numMoves) {
-    // Assumes sum of relativePriors is 1.
-    auto generator = getGenerator();
-    std::uniform_real_distribution<float> distribution(0.0, 1.0);
+// Rollout policy without the moves being made: the moves are scored from the features of the board.
+void calc_feature_priors(const PKBoard& board, ExtMove* moves, int size) {
+    alignas(32) float scores[MAX_MOVES];
+    if (board.sideToMove == WHITE) {
+        score_features<WHITE>(board, moves, size, scores);
+    } else {
+        score_features<BLACK>(board, moves, size, scores);
+    }
+
+    set_priors(moves, scores, size);
+}
 
-    float stopPoint = distribution(generator);
+// Moves the decisive ones first, keeping their order, and returns the end of the moves worth playing:
+// the promotions, which win on the spot, or under a promotion threat the moves stopping it.
+// All the moves are worth playing when none is decisive.
+ExtMove* decisive_moves(const PKBoard& board, ExtMove* begin, ExtMove* end) {
+    auto isPromotion = [](const ExtMove& m) { return type_of(m.move) == PROMOTION; };
+    if (std::any_of(begin, end, isPromotion)) {
+        return std::stable_partition(begin, end, isPromotion);
+    }
 
+    const Bitboard seventh = board.sideToMove == WHITE ? Rank2BB : Rank7BB;
+    if (!(board.pawns[~board.sideToMove] & seventh)) {
+        return end;
+    }
+
+    PKBoard next;
+    ExtMove* stopping = std::stable_partition(begin, end, [&](const ExtMove& m) {
+        board.do_move(m.move, next);
+        return !next.can_promote();
+    });
+    return stopping != begin ? stopping : end;
+}
+
+Move sampleMove(PRNG& rng, const ExtMove* moves, int size) {
+    float stopPoint = float(rng.rand_unit());
+
+    // The priors may sum to a little less than 1 after rounding, the last move takes the rest.
     float partialSum = 0;
     int i = 0;
-    while (i < numMoves && partialSum <= stopPoint) {
-        partialSum += moves[i].relativePrior;
+    while (i < size && partialSum <= stopPoint) {
+        partialSum += moves[i].getPrior();
         i++;
     }
 
     return moves[i - 1];
-}
\ No newline at end of file
+}
+
+void sample_order(Position& pos, ExtMove* moves, int size) {
+    // Gumbel-top-k: sorting by log(prior) + Gumbel noise draws the whole list at once,
+    // as sampling without replacement proportionally to the priors (e^x here) would.
+    PRNG& rng = pos.this_thread()->rng;
+
+    std::pair<double, ExtMove> keyed[MAX_MOVES];
+    for (int i = 0; i < size; i++) {
+        double u = std::max(rng.rand_unit(), DBL_MIN);
+        keyed[i] = std::make_pair(std::log(moves[i].getPrior()) - std::log(-std::log(u)), moves[i]);
+    }
+
+    std::sort(keyed, keyed + size, [](const std::pair<double, ExtMove>& a, const std::pair<double, ExtMove>& b) {
+        return a.first > b.first;
+    });
+
+    for (int i = 0; i < size; i++) {
+        moves[i] = keyed[i].second;
+    }
+}
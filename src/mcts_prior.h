@@ -1,31 +1,48 @@
 #ifndef SRC_MCTS_PRIOR_H
 #define SRC_MCTS_PRIOR_H
 
+#include "misc.h"
 #include "movegen.h"
 #include "position.h"
+#include "mcts_pkboard.h"
 
-struct UnopenedMove {
-    Move move;
-    float expPrior;
-    float relativePrior; // In [0, 1], divided by the sum of e^x for all yet unopened moves.
-    float absolutePrior; // In [0, 1], divided by the sum of all e^x
-
-    UnopenedMove(Move _move, float _expPrior, float _prior) : move(_move), expPrior(_expPrior), absolutePrior(_prior), relativePrior(_prior) {
-        assert(_expPrior > 0);
-        assert(_prior > 0);
-    }
-    UnopenedMove() = default;
-
-    bool operator==(const UnopenedMove& other) {
-        return move == other.move;
-    }
-};
-
-void calc_exp_evals(Position& pos, ExtMove* moves, int size);
 void calc_priors(Position& pos, ExtMove* moves, int size);
-Move sampleMove(Position& pos, ExtMove* moves);
-UnopenedMove sampleMove(Position& pos, UnopenedMove* moves, int numMoves);
+void calc_priors(const PKBoard& board, ExtMove* moves, int size);
+void calc_feature_priors(const PKBoard& board, ExtMove* moves, int size);
+ExtMove* decisive_moves(const PKBoard& board, ExtMove* begin, ExtMove* end);
+Move sampleMove(PRNG& rng, const ExtMove* moves, int size);
+void sample_order(Position& pos, ExtMove* moves, int size);
 Value safeEval(Position& pos, Move move /*player*/, CheckInfo& ci /*already computed for pos*/, StateInfo& st);
 Value qeval(Position& pos);
 
+// Buffers of the iterative qeval, one per thread: a frame for every position in check down the line.
+struct QevalStack {
+    static const int MaxPly = 16;
+
+    struct Frame {
+        ExtMove moves[MAX_MOVES];
+        ExtMove* current;
+        ExtMove* end;
+        Value best;
+        StateInfo st; // Of the move being searched
+    };
+
+    Frame frames[MaxPly];
+};
+
+// Evals of the positions seen again, the siblings transpose and the leaves are evaluated more than once.
+// The positions in check have no static eval, their entries hold the qeval.
+// Every thread has a table of its own, like the pawns and material tables.
+namespace EvalCache {
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    typedef HashTable<Entry, 65536> Table;
+
+    // Eval::evaluate through the table of the thread of pos, the pawns and kings one when there are no pieces.
+    Value evaluate(const Position& pos);
+}
+
 #endif //SRC_MCTS_PRIOR_H
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <sstream>
 #include "syzygy/tbprobe.h"
 #include "mcts_pv.h"
@@ -12,7 +13,8 @@ std::string mcts_pv_print(MCTS_Node& root) {
     int64_t nodes_searched = Threads.nodes_searched();
 
     std::vector<Move> pvMoves = std::vector<Move>();
-    MCTS_PV pv = mctsPv(&root, pvMoves);
+    std::vector<MCTS_Node*> pvNodes = std::vector<MCTS_Node*>();
+    MCTS_PV pv = mctsPv(&root, pvMoves, pvNodes);
 
     if (pv.depth <= 1)
         return "";
@@ -44,24 +46,29 @@ std::string mcts_pv_print(MCTS_Node& root) {
     return ss.str();
 }
 
-MCTS_PV mctsPv(MCTS_Node* node, std::vector<Move>& pvBuffer) {
-    if (node == nullptr || node->totalVisits < Search::pvThreshold || !node->fully_opened() /*leaf*/) {
+MCTS_PV mctsPv(MCTS_Node* node, std::vector<Move>& pvBuffer, std::vector<MCTS_Node*>& pvNodes) {
+    // The graph has cycles through repeated positions, stop at the first repetition.
+    if (node == nullptr || std::find(pvNodes.begin(), pvNodes.end(), node) != pvNodes.end()) {
         return MCTS_PV(std::vector<Move>(0), 0 /*changed in rec*/, Time.elapsed() + 1, 0, Threads.nodes_searched());
     }
-    MCTS_Edge* bestEdge = node->selectBest();
-    if (bestEdge != nullptr) {
-        pvBuffer.push_back(bestEdge->move);
-        MCTS_PV childPv = mctsPv(&bestEdge->node, pvBuffer);
-        // childPv.moves.push_back(bestEdge->move);
-        childPv.moves = pvBuffer;
-        childPv.depth++;
-        if (node->incoming_edge == nullptr)
-            childPv.score = bestEdge->score();
-        return childPv;
-    } else {
-        return mctsPv(nullptr, pvBuffer);
-    }
 
+    int best = node->totalVisits < Search::pvThreshold || !node->fully_opened() /*leaf*/ ? -1 : node->selectBest();
+    if (best == -1) {
+        return mctsPv(nullptr, pvBuffer, pvNodes);
+    }
+    bool root = pvBuffer.empty();
+    int score = node->score(best);
+    MCTS_Node* child = node->children[best].load(std::memory_order_acquire);
+    pvBuffer.push_back(node->moves[best]);
+
+    pvNodes.push_back(node);
+    MCTS_PV childPv = mctsPv(child, pvBuffer, pvNodes);
+    // childPv.moves.push_back(bestEdge->move);
+    childPv.moves = pvBuffer;
+    childPv.depth++;
+    if (root)
+        childPv.score = score;
+    return childPv;
 }
 
 // check_time() is used to print debug info and, more importantly, to detect
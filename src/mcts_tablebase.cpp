@@ -36,3 +36,12 @@ void initTableBase() {
         TB::ProbeDepth = DEPTH_ZERO;
     }
 }
+
+bool isInTableBase(const PKBoard& board, Thread* th, PlayingResult* playingResult) {
+    if (board.piece_count() > TB::Cardinality)
+        return false;
+
+    Position pos;
+    pos.set(board.fen(), false, th);
+    return isInTableBase(pos, playingResult);
+}
@@ -3,8 +3,10 @@
 
 #include "position.h"
 #include "mcts_chess_playing.h"
+#include "mcts_pkboard.h"
 
 void initTableBase();
 bool isInTableBase(Position& position, PlayingResult* playingResult);
+bool isInTableBase(const PKBoard& board, Thread* th, PlayingResult* playingResult);
 
 #endif //SRC_MCTS_TABLEBASE_H
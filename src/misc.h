@@ -91,6 +91,9 @@ public:
 
   template<typename T> T rand() { return T(rand64()); }
 
+  /// Uniform double in [0, 1), made of the 53 high bits.
+  double rand_unit() { return (rand64() >> 11) * (1.0 / 9007199254740992.0); }
+
   /// Special generator used to fast init magic numbers.
   /// Output values only have 1/8th of their bits set on average.
   template<typename T> T sparse_rand()
@@ -40,7 +40,7 @@ struct ExtMove {
 
   operator Move() const { return move; }
   void operator=(Move m) { move = m; }
-  float getPrior() {
+  float getPrior() const {
       union {float f; int i;} eval;
       eval.i = value;
       return eval.f;
@@ -976,6 +976,27 @@ Key Position::key_after(Move m) const {
 }
 
 
+/// Position::pawn_key_after() computes the new pawn hash key after the given
+/// move, for the prefetch of the pawn hash entry. Like key_after() it doesn't
+/// recognize en-passant and promotions.
+
+Key Position::pawn_key_after(Move m) const {
+
+  Color us = sideToMove;
+  Square from = from_sq(m);
+  Square to = to_sq(m);
+  Key k = st->pawnKey;
+
+  if (type_of(piece_on(to)) == PAWN)
+      k ^= Zobrist::psq[~us][PAWN][to];
+
+  if (type_of(piece_on(from)) == PAWN)
+      k ^= Zobrist::psq[us][PAWN][from] ^ Zobrist::psq[us][PAWN][to];
+
+  return k;
+}
+
+
 /// Position::see() is a static exchange evaluator: It tries to estimate the
 /// material gain or loss resulting from a move.
 
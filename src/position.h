@@ -157,6 +157,7 @@ public:
   // Accessing hash keys
   Key key() const;
   Key key_after(Move m) const;
+  Key pawn_key_after(Move m) const;
   Key exclusion_key() const;
   Key material_key() const;
   Key pawn_key() const;
@@ -36,7 +36,9 @@
 #include "uci.h"
 #include "syzygy/tbprobe.h"
 #include "mcts.h"
+#include "mcts_leaf.h"
 #include "mcts_pv.h"
+#include "mcts_tablebase.h"
 
 namespace Search {
 
@@ -183,6 +185,8 @@ void Search::clear() {
 
   TT.clear();
   CounterMovesHistory.clear();
+  for (Thread* th : Threads)
+      th->mctsTree.clear();
 
   for (Thread* th : Threads)
   {
@@ -295,6 +299,8 @@ void MainThread::stockfish_main_search() {
             {
                 th->rootPos = Position(rootPos, th);
                 th->rootMoves = rootMoves;
+                th->searchTree = nullptr;
+                th->rolloutWorker = false;
                 th->start_searching();
             }
         }
@@ -352,7 +358,29 @@ void MainThread::stockfish_main_search() {
 
 
 void MainThread::mcts_main_search() {
-    MCTS_Node mcts_root;
+    // Leaf parallel: the helper threads play the rollouts of the leaves of the main thread.
+    // Root parallel: every thread searches a tree of its own, the trees are merged at the end.
+    // Otherwise all the threads search the tree of the main thread.
+    int rolloutsPerLeaf = Options["Leaf Rollouts"];
+    bool leafParallel = Search::leafRollouts && rolloutsPerLeaf > 1 && Threads.size() > 1;
+    bool rootParallel = Options["Root Parallel"] && !leafParallel;
+    // The rollouts may be cut short and graded by the eval, the adjudication threshold is in percent
+    LeafRollouts.start(rolloutsPerLeaf, leafParallel ? int(Threads.size()) - 1 : 0,
+                       Options["Rollout Plies"], int(Options["Rollout Adjudication"]) / 100.0,
+                       Options["Rollout Feature Policy"]);
+
+    size_t budget = size_t(Options["Hash"]) << 20;
+    for (Thread* th : Threads)
+        if (th == this || rootParallel)
+        {
+            th->mctsTree.set_budget(rootParallel ? budget / Threads.size() : budget);
+            th->mctsTree.set_root(rootPos);
+        }
+
+    // A fixed seed makes the search reproducible, 0 draws a new one for every search
+    uint64_t seed = int(Options["Seed"]) ? uint64_t(int(Options["Seed"])) : uint64_t(now());
+    for (Thread* th : Threads)
+        th->rng = PRNG((seed + th->idx + 1) * 0x9E3779B97F4A7C15ULL | 1);
 
     Color us = rootPos.side_to_move();
     Time.init(Limits, us, rootPos.game_ply());
@@ -413,7 +441,20 @@ void MainThread::mcts_main_search() {
                                                                                  :  VALUE_DRAW;
             }
         }
-        mctsSearch(rootPos, mcts_root);
+        // Read by every thread during the search
+        initTableBase();
+
+        for (Thread* th : Threads)
+            if (th != this)
+            {
+                th->rootPos = Position(rootPos, th);
+                th->rootMoves = rootMoves;
+                th->searchTree = leafParallel ? nullptr : rootParallel ? &th->mctsTree : &mctsTree;
+                th->rolloutWorker = leafParallel;
+                th->start_searching();
+            }
+
+        mctsSearch(rootPos, mctsTree); // Let's start searching!
     }
 
     // When playing in 'nodes as time' mode, subtract the searched nodes from
@@ -434,19 +475,43 @@ void MainThread::mcts_main_search() {
 
     // Stop the threads if not already stopped
     Signals.stop = true;
+    LeafRollouts.stop();
 
-    // Send new PV when needed
-    sync_cout << mcts_pv_print(mcts_root) << sync_endl;
+    // Wait until all threads have finished
+    for (Thread* th : Threads)
+        if (th != this)
+            th->wait_for_search_finished();
+
+    // Pruning may have moved the root
+    MCTS_Node* mcts_root = mctsTree.get_root();
+    Move bestMove = mcts_root->numChildren > 0 ? mcts_root->moves[mcts_root->selectBest()] : MOVE_NONE;
 
+    if (rootParallel && bestMove != MOVE_NONE)
+    {
+        std::vector<MCTS_Node*> roots;
+        for (Thread* th : Threads)
+            roots.push_back(th->mctsTree.get_root());
 
-    if(mcts_root.initialized && !mcts_root.edges.empty()) {
-        MCTS_Edge& bestEdge = *mcts_root.selectBest();
+        bestMove = merged_best_move(roots);
 
-        sync_cout << "bestmove " << UCI::move(bestEdge.move, rootPos.is_chess960());
+        // Show the PV of the tree that is the most sure of the chosen move
+        NumVisits maxVisits = 0;
+        for (MCTS_Node* root : roots)
+        {
+            int best = root->selectBest();
+            if (best != -1 && root->moves[best] == bestMove && root->numRollouts[best] > maxVisits)
+                maxVisits = root->numRollouts[best], mcts_root = root;
+        }
     }
 
+    // Send new PV when needed
+    sync_cout << mcts_pv_print(*mcts_root) << sync_endl;
 
-    std::cout << sync_endl;
+    // Stopped before the first iteration, or no legal move
+    if (bestMove == MOVE_NONE)
+        bestMove = rootMoves[0].pv[0];
+
+    sync_cout << "bestmove " << UCI::move(bestMove, rootPos.is_chess960()) << sync_endl;
 }
 
 void MainThread::search() {
@@ -460,6 +525,18 @@ void MainThread::search() {
 
 void Thread::search() {
 
+  if (searchTree)
+  {
+      mctsSearch(rootPos, *searchTree);
+      return;
+  }
+
+  if (rolloutWorker)
+  {
+      LeafRollouts.work(this);
+      return;
+  }
+
   Stack stack[MAX_PLY+4], *ss = stack+2; // To allow referencing (ss-2) and (ss+2)
   Value bestValue, alpha, beta, delta;
   Move easyMove = MOVE_NONE;
@@ -33,9 +33,10 @@ ThreadPool Threads; // Global object
 /// Thread constructor launch the thread and then wait until it goes to sleep
 /// in idle_loop().
 
-Thread::Thread() {
+Thread::Thread() : rng(1070372) {
 
-  resetCalls = exit = false;
+  resetCalls = exit = rolloutWorker = false;
+  searchTree = nullptr;
   maxPly = callsCnt = 0;
   history.clear();
   counterMoves.clear();
@@ -29,6 +29,8 @@
 #include <vector>
 
 #include "material.h"
+#include "mcts.h"
+#include "misc.h"
 #include "movepick.h"
 #include "pawns.h"
 #include "position.h"
@@ -59,6 +61,8 @@ public:
 
   Pawns::Table pawnsTable;
   Material::Table materialTable;
+  EvalCache::Table evalCache;
+  QevalStack qevalStack;
   Endgames endgames;
   size_t idx, PVIdx;
   int maxPly, callsCnt;
@@ -70,6 +74,10 @@ public:
   MovesStats counterMoves;
   Depth completedDepth;
   std::atomic_bool resetCalls;
+  MCTS_Tree mctsTree; // Kept between searches to reuse the subtree of the new root
+  MCTS_Tree* searchTree; // Tree searched with MCTS, nullptr for the alpha-beta search
+  bool rolloutWorker; // Play the rollouts of the main thread's leaves instead (leaf parallel search)
+  PRNG rng; // MCTS rollouts and move ordering, seeded at the start of every search
 };
 
 
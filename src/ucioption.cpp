@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <ostream>
 
 #include "misc.h"
@@ -74,6 +75,12 @@ void init(OptionsMap& o) {
   o["SyzygyProbeDepth"]      << Option(1, 1, 100);
   o["Syzygy50MoveRule"]      << Option(true);
   o["SyzygyProbeLimit"]      << Option(6, 0, 6);
+  o["Seed"]                  << Option(0, 0, INT_MAX);
+  o["Root Parallel"]         << Option(false);
+  o["Leaf Rollouts"]         << Option(1, 1, 256);
+  o["Rollout Plies"]         << Option(MAX_PLY, 1, MAX_PLY);
+  o["Rollout Adjudication"]  << Option(100, 1, 100);
+  o["Rollout Feature Policy"] << Option(false);
 }
 
 